@@ -20,12 +20,26 @@ if __name__ == '__main__':
         "--l", type=int, default=2, help="Overwrites default lambda value for scoring")
     parser.add_argument(
         "--m", type=int, default=10, help="Overwrites default number of tries")
+    parser.add_argument("--max-memory", type=int, default=0,
+                        help="Memory budget in bytes for the tries during the format build (0 = unlimited)")
+    parser.add_argument("--candidates", type=int, default=0,
+                        help="Number of tries scored exactly per column, picked by row sketch overlap (0 = all)")
+    parser.add_argument("--growth-threshold", type=float, default=1.0,
+                        help="Start a new trie only when the best existing score exceeds this multiple of an empty trie's")
+    parser.add_argument("--retire-after", type=int, default=0,
+                        help="Finalize tries not selected for this many columns (0 = never)")
+    parser.add_argument("--hops", type=int, default=1,
+                        help="Number of propagation steps per iteration, run in a single call (staf only)")
+    parser.add_argument("--alpha", type=float, default=0.0,
+                        help="Teleport probability mixed into every propagation step (staf only)")
     parser.add_argument("--warmup", type=int, default=10,
                         help="Number of warmup iterations.")
     parser.add_argument("--skip", type=bool, default=False,
                         help="Skip the format build and load the data from the previous runs based on configuration")
 
     args = parser.parse_args()
+    if (args.hops > 1 or args.alpha != 0.0) and args.operation != "staf":
+        parser.error("--hops and --alpha are only supported by staf")
 
     # Load dataset
     dataset = load_dataset(args.dataset)
@@ -34,7 +48,12 @@ if __name__ == '__main__':
     # Convert adjacency matrices in the format specified in '--operation'
     a = set_adjacency_matrix(
         args.operation, dataset.edge_index, l=args.l, m=args.m,
-        dataset=args.dataset, skip=args.skip)
+        dataset=args.dataset, skip=args.skip, max_memory=args.max_memory,
+        candidates=args.candidates, growth_threshold=args.growth_threshold,
+        retire_after=args.retire_after)
+    if getattr(a, "memory", None):
+        print(f"peak memory: {a.memory['peak_memory']} bytes, "
+              f"final memory: {a.memory['final_memory']} bytes")
 
     performance = []
     with inference_mode():
@@ -44,7 +63,10 @@ if __name__ == '__main__':
             time_start = time()
 
             # matrix multiplication
-            a.matmul(x, y)
+            if args.hops > 1 or args.alpha != 0.0:
+                a.propagate(x, y, args.hops, args.alpha)
+            else:
+                a.matmul(x, y)
 
             time_end = time()
             performance.append(time_end - time_start)
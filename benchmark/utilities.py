@@ -1,5 +1,5 @@
 from staf.staf import staf
-from torch import zeros, ones, int32, float32, arange, randint
+from torch import zeros, ones, float32, arange, randint
 
 # dataset packages
 from ogb.nodeproppred import PygNodePropPredDataset
@@ -11,9 +11,11 @@ from torch_geometric.datasets import TUDataset, SuiteSparseMatrixCollection, Pla
 ############################################################
 
 
-def set_adjacency_matrix(format, edge_index, l, m, dataset, skip):
+def set_adjacency_matrix(format, edge_index, l, m, dataset, skip, max_memory=0, candidates=0,
+                         growth_threshold=1.0, retire_after=0):
     if format == "staf":
-        return staf(edge_index.to(int32), ones(edge_index.size(1), dtype=float32), l, m, dataset, skip)
+        return staf(edge_index, ones(edge_index.size(1), dtype=float32), l, m, dataset, skip, max_memory,
+                    candidates=candidates, growth_threshold=growth_threshold, retire_after=retire_after)
     else:
         raise NotImplementedError(f"Format {format} is not valid")
 
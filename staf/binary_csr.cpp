@@ -3,20 +3,22 @@
 #include <tuple>
 #include <vector>
 
-binary_csr::binary_csr(
-    const std::map<int, std::vector<int>> &unique_patterns,
-    std::map<std::vector<int>, std::vector<int>> &shared_patterns,
-    int no_rows) {
+template <typename offset_t, typename index_t>
+binary_csr<offset_t, index_t>::binary_csr(
+    const std::map<index_t, std::vector<index_t>> &unique_patterns,
+    std::map<std::vector<index_t>, std::vector<index_t>> &shared_patterns,
+    index_t no_rows, bool with_values) {
   row_ptr.reserve(no_rows + 1);
   row_ptr.push_back(0);
 
   // Process unique patterns (row-wise storage)
-  for (int row = 0; row < no_rows; ++row) {
+  for (index_t row = 0; row < no_rows; ++row) {
     auto it = unique_patterns.find(row);
     if (it != unique_patterns.end()) {
-      const std::vector<int> &cols = it->second;
+      const std::vector<index_t> &cols = it->second;
       col_indices.insert(col_indices.end(), cols.begin(), cols.end());
-      data.insert(data.end(), cols.size(), 1.0f);
+      if (with_values)
+        data.insert(data.end(), cols.size(), 1.0f);
       row_ptr.push_back(row_ptr.back() + cols.size());
     } else {
       row_ptr.push_back(row_ptr.back());
@@ -26,20 +28,37 @@ binary_csr::binary_csr(
   suffix_row_ptr.push_back(0);
   map_suffix_ptr.push_back(0);
   for (const auto &pair : shared_patterns) {
-    const std::vector<int> &pattern_cols = pair.second;
+    const std::vector<index_t> &pattern_cols = pair.second;
 
     suffix_col_indices.insert(suffix_col_indices.end(), pattern_cols.begin(),
                               pattern_cols.end());
-    suffix_data.insert(suffix_data.end(), pattern_cols.size(), 1.0f);
+    if (with_values)
+      suffix_data.insert(suffix_data.end(), pattern_cols.size(), 1.0f);
     suffix_row_ptr.push_back(suffix_row_ptr.back() + pattern_cols.size());
     std::vector rows_to_map = pair.first;
     map_row_index.insert(map_row_index.end(), rows_to_map.begin(),
                          rows_to_map.end());
-    map_suffix_ptr.push_back(rows_to_map.size());
+    map_suffix_ptr.push_back(map_suffix_ptr.back() + rows_to_map.size());
+  }
+
+  // Invert the map with a counting sort over the rows.
+  row_pattern_ptr.assign(no_rows + 1, 0);
+  for (index_t row : map_row_index)
+    row_pattern_ptr[row + 1]++;
+  for (index_t row = 0; row < no_rows; ++row)
+    row_pattern_ptr[row + 1] += row_pattern_ptr[row];
+
+  std::vector<offset_t> next(row_pattern_ptr.begin(),
+                             row_pattern_ptr.end() - 1);
+  row_pattern_index.resize(map_row_index.size());
+  for (size_t p = 0; p + 1 < map_suffix_ptr.size(); ++p) {
+    for (offset_t i = map_suffix_ptr[p]; i < map_suffix_ptr[p + 1]; ++i)
+      row_pattern_index[next[map_row_index[i]]++] = p;
   }
 }
 
-void binary_csr::print() const {
+template <typename offset_t, typename index_t>
+void binary_csr<offset_t, index_t>::print() const {
   std::cout << "Row pointers: [";
   for (size_t i = 0; i < row_ptr.size(); ++i) {
     std::cout << row_ptr[i];
@@ -68,23 +87,24 @@ void binary_csr::print() const {
   std::cout << "]" << std::endl;
 }
 
-void binary_csr::print_dense_matrix() const {
-  int num_rows = row_ptr.size() - 1;
-  int num_cols = 0;
+template <typename offset_t, typename index_t>
+void binary_csr<offset_t, index_t>::print_dense_matrix() const {
+  index_t num_rows = row_ptr.size() - 1;
+  index_t num_cols = 0;
 
-  for (int col : col_indices) {
+  for (index_t col : col_indices) {
     if (col + 1 > num_cols) {
       num_cols = col + 1;
     }
   }
 
-  for (int row = 0; row < num_rows; ++row) {
+  for (index_t row = 0; row < num_rows; ++row) {
     std::vector<float> dense_row(num_cols, 0.0f);
-    int start = row_ptr[row];
-    int end = row_ptr[row + 1];
+    offset_t start = row_ptr[row];
+    offset_t end = row_ptr[row + 1];
 
-    for (int idx = start; idx < end; ++idx) {
-      dense_row[col_indices[idx]] = data[idx];
+    for (offset_t idx = start; idx < end; ++idx) {
+      dense_row[col_indices[idx]] = data.empty() ? 1.0f : data[idx];
     }
 
     for (float val : dense_row) {
@@ -93,28 +113,54 @@ void binary_csr::print_dense_matrix() const {
     std::cout << "\n";
   }
 }
-const std::vector<int> &binary_csr::get_row_ptr() const { return row_ptr; }
+template <typename offset_t, typename index_t>
+const std::vector<offset_t> &
+binary_csr<offset_t, index_t>::get_row_ptr() const {
+  return row_ptr;
+}
 
-const std::vector<int> &binary_csr::get_col_indices() const {
+template <typename offset_t, typename index_t>
+const std::vector<index_t> &
+binary_csr<offset_t, index_t>::get_col_indices() const {
   return col_indices;
 }
 
-const std::vector<float> &binary_csr::get_data() const { return data; }
+template <typename offset_t, typename index_t>
+const std::vector<float> &binary_csr<offset_t, index_t>::get_data() const {
+  return data;
+}
 
-const std::tuple<std::vector<int>, std::vector<int>>
-binary_csr::get_mapped_rows() const {
+template <typename offset_t, typename index_t>
+const std::tuple<std::vector<offset_t>, std::vector<index_t>>
+binary_csr<offset_t, index_t>::get_mapped_rows() const {
   return std::make_tuple(map_suffix_ptr, map_row_index);
 }
 
-const std::vector<int> &binary_csr::get_suffix_row_ptr() const {
+template <typename offset_t, typename index_t>
+const std::tuple<std::vector<offset_t>, std::vector<index_t>>
+binary_csr<offset_t, index_t>::get_row_patterns() const {
+  return std::make_tuple(row_pattern_ptr, row_pattern_index);
+}
+
+template <typename offset_t, typename index_t>
+const std::vector<offset_t> &
+binary_csr<offset_t, index_t>::get_suffix_row_ptr() const {
   return suffix_row_ptr;
 };
 
-const std::vector<int> &binary_csr::get_suffix_col_indices() const {
+template <typename offset_t, typename index_t>
+const std::vector<index_t> &
+binary_csr<offset_t, index_t>::get_suffix_col_indices() const {
 
   return suffix_col_indices;
 };
 
-const std::vector<float> &binary_csr::get_suffix_data() const {
+template <typename offset_t, typename index_t>
+const std::vector<float> &
+binary_csr<offset_t, index_t>::get_suffix_data() const {
   return suffix_data;
 };
+
+template class binary_csr<int32_t, int32_t>;
+template class binary_csr<int64_t, int32_t>;
+template class binary_csr<int64_t, int64_t>;
@@ -1,7 +1,9 @@
 #ifndef BINARY_CSR_HPP
 #define BINARY_CSR_HPP
 
+#include <cstdint>
 #include <map>
+#include <tuple>
 #include <vector>
 
 /**
@@ -12,17 +14,23 @@
  * This class takes in unique and shared patterns to construct a binary CSR
  * matrix where values are either 1.0 (present) or 0.0 (absent). It provides
  * functionality to print the CSR structure and also its dense representation.
+ *
+ * @tparam offset_t Integer type of the row pointer arrays.
+ * @tparam index_t Integer type of the row and column indices.
  */
+template <typename offset_t = int32_t, typename index_t = int32_t>
 class binary_csr {
 private:
-  std::vector<int> row_ptr;
-  std::vector<int> col_indices;
+  std::vector<offset_t> row_ptr;
+  std::vector<index_t> col_indices;
   std::vector<float> data;
-  std::vector<int> suffix_row_ptr;
-  std::vector<int> suffix_col_indices;
+  std::vector<offset_t> suffix_row_ptr;
+  std::vector<index_t> suffix_col_indices;
   std::vector<float> suffix_data;
-  std::vector<int> map_suffix_ptr;
-  std::vector<int> map_row_index;
+  std::vector<offset_t> map_suffix_ptr;
+  std::vector<index_t> map_row_index;
+  std::vector<offset_t> row_pattern_ptr;
+  std::vector<index_t> row_pattern_index;
 
 public:
   /**
@@ -33,10 +41,13 @@ public:
    * @param shared_patterns A map of common column patterns mapped to the list
    * of rows that share them. These are appended after unique patterns.
    * @param no_rows The total number of rows in the matrix.
+   * @param with_values Whether to store the all-ones data and suffix_data
+   * arrays. They carry no information for a binary matrix.
    */
-  binary_csr(const std::map<int, std::vector<int>> &unique_patterns,
-             std::map<std::vector<int>, std::vector<int>> &shared_patterns,
-             int no_rows);
+  binary_csr(
+      const std::map<index_t, std::vector<index_t>> &unique_patterns,
+      std::map<std::vector<index_t>, std::vector<index_t>> &shared_patterns,
+      index_t no_rows, bool with_values = true);
 
   /**
    * @brief Prints the CSR structure (row_ptr, col_indices, and data).
@@ -52,17 +63,18 @@ public:
    * @brief Returns the row pointer array of the CSR matrix.
    * @return const reference to the row_ptr vector.
    */
-  const std::vector<int> &get_row_ptr() const;
+  const std::vector<offset_t> &get_row_ptr() const;
 
   /**
    * @brief Returns the column indices of the CSR matrix.
    * @return const reference to the col_indices vector.
    */
-  const std::vector<int> &get_col_indices() const;
+  const std::vector<index_t> &get_col_indices() const;
 
   /**
    * @brief Returns the data values of the CSR matrix.
-   * @return const reference to the data vector.
+   * @return const reference to the data vector, empty if the matrix was built
+   * without values.
    */
   const std::vector<float> &get_data() const;
 
@@ -70,13 +82,13 @@ public:
    * @brief Returns the row pointer array of the CSR matrix.
    * @return const reference to the row_ptr vector.
    */
-  const std::vector<int> &get_suffix_row_ptr() const;
+  const std::vector<offset_t> &get_suffix_row_ptr() const;
 
   /**
    * @brief Returns the column indices of the CSR matrix.
    * @return const reference to the col_indices vector.
    */
-  const std::vector<int> &get_suffix_col_indices() const;
+  const std::vector<index_t> &get_suffix_col_indices() const;
 
   /**
    * @brief Returns the data values of the CSR matrix.
@@ -84,7 +96,20 @@ public:
    */
   const std::vector<float> &get_suffix_data() const;
 
-  const std::tuple<std::vector<int>, std::vector<int>> get_mapped_rows() const;
+  /**
+   * @brief Returns the map from every shared pattern to its rows: the offsets
+   * of each pattern's rows (n_patterns + 1 entries) and the rows themselves.
+   */
+  const std::tuple<std::vector<offset_t>, std::vector<index_t>>
+  get_mapped_rows() const;
+
+  /**
+   * @brief Returns the inverse of the map, the shared patterns of every row
+   * in ascending order: the row offsets (n_rows + 1 entries) and the pattern
+   * numbers. Lets each output row gather its pattern results itself.
+   */
+  const std::tuple<std::vector<offset_t>, std::vector<index_t>>
+  get_row_patterns() const;
 };
 
 #endif
@@ -0,0 +1,184 @@
+#include "packed_indices.hpp"
+#include <algorithm>
+#include <bit>
+#include <immintrin.h>
+#include <limits>
+#include <stdexcept>
+
+template <typename offset_t, typename index_t>
+packed_indices<offset_t, index_t>::packed_indices(const offset_t *seg_ptr,
+                                                  const index_t *values,
+                                                  index_t n_segments) {
+  block_ptr.reserve(n_segments / packed_block_size + 1);
+  bases.reserve(n_segments);
+  widths.reserve(n_segments);
+
+  std::vector<index_t> segment;
+  for (index_t s = 0; s < n_segments; s++) {
+    if (s % packed_block_size == 0)
+      block_ptr.push_back(words.size());
+    segment.assign(values + seg_ptr[s], values + seg_ptr[s + 1]);
+    std::sort(segment.begin(), segment.end());
+
+    uint64_t max_gap = 0;
+    for (size_t i = 1; i < segment.size(); i++) {
+      uint64_t gap = static_cast<uint64_t>(segment[i] - segment[i - 1]);
+      if (gap == 0)
+        throw std::invalid_argument("segment holds an index twice");
+      max_gap = std::max(max_gap, gap - 1);
+    }
+    if (max_gap > std::numeric_limits<uint32_t>::max())
+      throw std::overflow_error("index gap does not fit into 32 bits");
+
+    const int width = std::bit_width(max_gap);
+    bases.push_back(segment.empty() ? 0 : segment[0]);
+    widths.push_back(width);
+
+    uint64_t acc = 0;
+    int filled = 0;
+    for (size_t i = 1; i < segment.size() && width > 0; i++) {
+      uint64_t gap = static_cast<uint64_t>(segment[i] - segment[i - 1]);
+      acc |= (gap - 1) << filled;
+      filled += width;
+      if (filled >= 32) {
+        words.push_back(static_cast<uint32_t>(acc));
+        acc >>= 32;
+        filled -= 32;
+      }
+    }
+    if (filled > 0)
+      words.push_back(static_cast<uint32_t>(acc));
+  }
+
+  // Decoders read one word past the end of a segment.
+  words.push_back(0);
+  words.push_back(0);
+}
+
+template <typename offset_t, typename index_t>
+const std::vector<uint32_t> &
+packed_indices<offset_t, index_t>::get_words() const {
+  return words;
+}
+
+template <typename offset_t, typename index_t>
+const std::vector<offset_t> &
+packed_indices<offset_t, index_t>::get_block_ptr() const {
+  return block_ptr;
+}
+
+template <typename offset_t, typename index_t>
+const std::vector<index_t> &
+packed_indices<offset_t, index_t>::get_bases() const {
+  return bases;
+}
+
+template <typename offset_t, typename index_t>
+const std::vector<uint8_t> &
+packed_indices<offset_t, index_t>::get_widths() const {
+  return widths;
+}
+
+template <typename offset_t, typename index_t>
+packed_view<offset_t, index_t>
+packed_indices<offset_t, index_t>::view(const offset_t *seg_ptr) const {
+  return {words.data(), block_ptr.data(), seg_ptr, bases.data(),
+          widths.data()};
+}
+
+namespace {
+#if defined(__AVX2__)
+/**
+ * @brief Decodes eight gaps starting at gap i, adds them to running and
+ * stores the eight resulting indices to out.
+ */
+inline __m256i decode_block(const uint32_t *words, size_t i, int width,
+                            __m256i running, int32_t *out) {
+  const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  const __m256i mask = _mm256_set1_epi32(
+      width == 32 ? -1 : static_cast<int32_t>((1u << width) - 1));
+
+  __m256i bit = _mm256_mullo_epi32(
+      _mm256_add_epi32(_mm256_set1_epi32(i), lane), _mm256_set1_epi32(width));
+  __m256i word = _mm256_srli_epi32(bit, 5);
+  __m256i shift = _mm256_and_si256(bit, _mm256_set1_epi32(31));
+
+  const int *base = reinterpret_cast<const int *>(words);
+  __m256i lo = _mm256_i32gather_epi32(base, word, 4);
+  __m256i hi = _mm256_i32gather_epi32(
+      base, _mm256_add_epi32(word, _mm256_set1_epi32(1)), 4);
+  // a shift count of 32 yields zero, so shift == 0 drops the high word
+  __m256i gap = _mm256_or_si256(
+      _mm256_srlv_epi32(lo, shift),
+      _mm256_sllv_epi32(hi, _mm256_sub_epi32(_mm256_set1_epi32(32), shift)));
+  gap = _mm256_add_epi32(_mm256_and_si256(gap, mask), _mm256_set1_epi32(1));
+
+  // inclusive prefix sum within both 128 bit lanes, then carry low to high
+  gap = _mm256_add_epi32(gap, _mm256_slli_si256(gap, 4));
+  gap = _mm256_add_epi32(gap, _mm256_slli_si256(gap, 8));
+  __m256i carry = _mm256_shuffle_epi32(gap, 0xFF);
+  gap = _mm256_add_epi32(gap, _mm256_permute2x128_si256(carry, carry, 0x08));
+
+  __m256i result = _mm256_add_epi32(gap, running);
+  _mm256_storeu_si256(reinterpret_cast<__m256i *>(out), result);
+  return _mm256_permutevar8x32_epi32(result, _mm256_set1_epi32(7));
+}
+#endif
+} // namespace
+
+template <typename offset_t, typename index_t>
+void decode_segment(const packed_view<offset_t, index_t> &v, index_t seg,
+                    size_t n, index_t *out) {
+  if (n == 0)
+    return;
+
+  offset_t word = v.block_ptr[seg / packed_block_size];
+  for (index_t j = seg - seg % packed_block_size; j < seg; j++)
+    word += packed_segment_words(v.seg_ptr[j + 1] - v.seg_ptr[j], v.widths[j]);
+
+  const uint32_t *words = v.words + word;
+  const int width = v.widths[seg];
+  index_t value = v.bases[seg];
+  out[0] = value;
+
+  if (width == 0) {
+    for (size_t i = 1; i < n; i++)
+      out[i] = value + static_cast<index_t>(i);
+    return;
+  }
+
+  // Gap i is stored at bit i * width of the segment.
+  const size_t gaps = n - 1;
+  size_t i = 0;
+#if defined(__AVX2__)
+  if constexpr (sizeof(index_t) == sizeof(int32_t)) {
+    if (gaps * width < std::numeric_limits<int32_t>::max()) {
+      __m256i running = _mm256_set1_epi32(value);
+      for (; i + 8 <= gaps; i += 8)
+        running = decode_block(words, i, width, running,
+                               reinterpret_cast<int32_t *>(out + 1 + i));
+      value = out[i];
+    }
+  }
+#endif
+
+  const uint64_t mask = (uint64_t{1} << width) - 1;
+  for (; i < gaps; i++) {
+    uint64_t bit = static_cast<uint64_t>(i) * width;
+    const uint32_t *w = words + (bit >> 5);
+    uint64_t window = w[0] | static_cast<uint64_t>(w[1]) << 32;
+    value += static_cast<index_t>(((window >> (bit & 31)) & mask) + 1);
+    out[i + 1] = value;
+  }
+}
+
+template class packed_indices<int32_t, int32_t>;
+template class packed_indices<int64_t, int32_t>;
+template class packed_indices<int64_t, int64_t>;
+
+template void decode_segment(const packed_view<int32_t, int32_t> &, int32_t,
+                             size_t, int32_t *);
+template void decode_segment(const packed_view<int64_t, int32_t> &, int32_t,
+                             size_t, int32_t *);
+template void decode_segment(const packed_view<int64_t, int64_t> &, int64_t,
+                             size_t, int64_t *);
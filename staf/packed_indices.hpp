@@ -0,0 +1,94 @@
+#ifndef PACKED_INDICES_HPP
+#define PACKED_INDICES_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @struct packed_view
+ * @brief Non-owning view of a packed_indices encoding, used by the decoders.
+ */
+template <typename offset_t, typename index_t> struct packed_view {
+  const uint32_t *words;     ///< Bit-packed gaps of all segments
+  const offset_t *block_ptr; ///< First word of every block of segments
+  const offset_t *seg_ptr;   ///< Start of every segment in the index array
+  const index_t *bases;      ///< Smallest index of every segment
+  const uint8_t *widths;     ///< Bit width of the gaps of every segment
+};
+
+/**
+ * @brief Number of segments sharing one entry of the block pointer array.
+ */
+constexpr int packed_block_size = 16;
+
+/**
+ * @class packed_indices
+ * @brief Delta and bit-packed encoding of a segmented index array, such as the
+ * column indices of a CSR matrix with its row pointer as segments.
+ *
+ * Every segment is sorted and stored as its smallest index plus the gaps
+ * between consecutive indices minus one, packed with the smallest bit width
+ * that fits the largest gap of the segment. Runs of consecutive indices thus
+ * take no space at all. Segments start on a 32 bit word boundary and only the
+ * first word of every block of packed_block_size segments is stored; the
+ * start of a segment within its block follows from the sizes and widths of
+ * the segments before it. The number of indices per segment is not stored
+ * either, it is given by the segment pointer array that is kept alongside.
+ *
+ * Indices within a segment must be distinct and gaps must fit into 32 bits.
+ */
+template <typename offset_t, typename index_t> class packed_indices {
+private:
+  std::vector<uint32_t> words;
+  std::vector<offset_t> block_ptr;
+  std::vector<index_t> bases;
+  std::vector<uint8_t> widths;
+
+public:
+  /**
+   * @brief Encodes a segmented index array.
+   *
+   * @param seg_ptr Start of every segment in values, n_segments + 1 entries.
+   * @param values The indices.
+   * @param n_segments Number of segments.
+   * @throws std::invalid_argument if a segment holds an index twice.
+   * @throws std::overflow_error if a gap does not fit into 32 bits.
+   */
+  packed_indices(const offset_t *seg_ptr, const index_t *values,
+                 index_t n_segments);
+
+  const std::vector<uint32_t> &get_words() const;
+  const std::vector<offset_t> &get_block_ptr() const;
+  const std::vector<index_t> &get_bases() const;
+  const std::vector<uint8_t> &get_widths() const;
+
+  /**
+   * @brief Returns a view of the encoding for the decoders.
+   * @param seg_ptr The segment pointer array the encoding was built from.
+   */
+  packed_view<offset_t, index_t> view(const offset_t *seg_ptr) const;
+};
+
+/**
+ * @brief Number of 32 bit words taken by a segment of n indices whose gaps
+ * are width bits wide.
+ */
+inline size_t packed_segment_words(size_t n, int width) {
+  return n > 1 ? ((n - 1) * width + 31) / 32 : 0;
+}
+
+/**
+ * @brief Decodes one segment. Uses AVX2 bit unpacking and an in-register
+ * prefix sum for 32 bit indices when available.
+ *
+ * @param v The encoding.
+ * @param seg Index of the segment.
+ * @param n Number of indices in the segment.
+ * @param out Destination for the n sorted indices.
+ */
+template <typename offset_t, typename index_t>
+void decode_segment(const packed_view<offset_t, index_t> &v, index_t seg,
+                    size_t n, index_t *out);
+
+#endif
@@ -30,6 +30,10 @@ setup(
             'staf_cpp',
             [
                 'staf_extensions.cpp',
+                'staf_spmm.cpp',
+                'staf_spgemm.cpp',
+                'staf_shard.cpp',
+                'packed_indices.cpp',
                 'suffix_forest.cpp',
                 'suffix_trie.cpp',
                 'binary_csr.cpp',
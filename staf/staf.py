@@ -4,27 +4,62 @@ import numpy as np
 import json
 
 
-class staf():
+def _csc_arguments(edge_index, edge_values):
+    """Converts an edge list into the CSC arguments of init_staf and
+    start_build: column pointers, row indices, values and the shape."""
+    # The ids stay 64-bit until the index type is chosen below.
+    edge_index = edge_index.to(torch.int64)
+    n_rows = n_cols = int(max(edge_index[0].max(), edge_index[1].max())) + 1
 
-    def __init__(self, edge_index, edge_values, l, m, dataset, skip):
-        if skip is False:
-            n_rows = n_cols = max(edge_index[0].max(), edge_index[1].max()) + 1
+    csc_tensor = torch.sparse_coo_tensor(
+        edge_index,
+        edge_values.to(torch.float32),
+        (n_rows, n_cols)
+    ).coalesce().to_sparse_csc()
+
+    # 64-bit offsets once the nonzeros, 64-bit ids once the rows,
+    # no longer fit into int32
+    int32_max = torch.iinfo(torch.int32).max
+    index_dtype = torch.int32 if n_rows <= int32_max else torch.int64
+    offset_dtype = torch.int32 if csc_tensor.values().numel() <= int32_max \
+        and index_dtype == torch.int32 else torch.int64
+
+    return (csc_tensor.ccol_indices().to(dtype=offset_dtype),
+            csc_tensor.row_indices().to(dtype=index_dtype),
+            csc_tensor.values().to(dtype=torch.float32),
+            n_rows, n_cols)
+
+
+def _check_map_layout(map_tensors, n_rows):
+    """Raises if map_tensors do not hold the four map arrays with prefix
+    offsets, as in matrices cached before the row pattern index."""
+    def is_offsets(ptr, indices, n):
+        return (ptr.numel() == n + 1 and int(ptr[0]) == 0
+                and bool((ptr[1:] >= ptr[:-1]).all())
+                and int(ptr[-1]) == indices.numel())
 
-            csc_tensor = torch.sparse_coo_tensor(
-                edge_index.to(torch.int32),
-                edge_values.to(torch.float32),
-                (n_rows, n_cols)
-            ).coalesce().to_sparse_csc()
+    if len(map_tensors) != 4 or not (
+            is_offsets(map_tensors[0], map_tensors[1],
+                       map_tensors[0].numel() - 1)
+            and is_offsets(map_tensors[2], map_tensors[3], n_rows)):
+        raise ValueError("the cached map tensors have an outdated layout, "
+                         "re-build the cache with skip=False")
 
+
+class staf():
+
+    def __init__(self, edge_index, edge_values, l, m, dataset, skip, max_memory=0,
+                 with_values=True, packed=False, candidates=0, growth_threshold=1.0,
+                 retire_after=0):
+        if skip is False:
             result = staf_cpp.init_staf(
-                csc_tensor.ccol_indices().to(dtype=torch.int32),
-                csc_tensor.row_indices().to(dtype=torch.int32),
-                csc_tensor.values().to(dtype=torch.float32),
-                n_rows, n_cols, l, m
+                *_csc_arguments(edge_index, edge_values), l, m, max_memory,
+                with_values, candidates, growth_threshold, retire_after
             )
             csr_tensors = result[0]
             suffix_tensors = result[1]
             map_tensors = result[2]
+            memory = result[3]
             torch.save(csr_tensors, f"csr_{dataset}_m_{m}_l_{l}.pt")
             torch.save(suffix_tensors, f"suffix_{dataset}_m_{m}_l_{l}.pt")
             torch.save(map_tensors, f"map_{dataset}_m_{m}_l_{l}.pt")
@@ -32,3 +67,236 @@ class staf():
             csr_tensors = torch.load(f"csr_{dataset}_m_{m}_l_{l}.pt")
             suffix_tensors = torch.load(f"suffix_{dataset}_m_{m}_l_{l}.pt")
             map_tensors = torch.load(f"map_{dataset}_m_{m}_l_{l}.pt")
+            _check_map_layout(map_tensors, csr_tensors[0].numel() - 1)
+            memory = None
+
+        # Matrices built from an edge list are square.
+        self._set_tensors(csr_tensors, suffix_tensors, map_tensors, packed,
+                          csr_tensors[0].numel() - 1)
+        # Peak and final bytes held by the live tries during the build, without
+        # the patterns of finalized tries, None when the matrix was loaded.
+        self.memory = memory
+
+    @classmethod
+    def from_tensors(cls, csr_tensors, suffix_tensors, map_tensors,
+                     packed=False, n_cols=None):
+        """Wraps the tensors of an already built STAF matrix, such as the
+        output of spgemm with structure=True. n_cols defaults to the largest
+        column index plus one."""
+        a = cls.__new__(cls)
+        a._set_tensors(csr_tensors, suffix_tensors, map_tensors, packed,
+                       n_cols)
+        a.memory = None
+        return a
+
+    def _set_tensors(self, csr_tensors, suffix_tensors, map_tensors, packed,
+                     n_cols):
+        # x needs at least one row per column.
+        if n_cols is None:
+            n_cols = max((int(t.max()) + 1 for t in
+                          (csr_tensors[1], suffix_tensors[1])
+                          if t.numel() > 0), default=0)
+        self.n_cols = n_cols
+
+        # Work partition of the SpMM, one part per thread.
+        self.schedule = staf_cpp.schedule_staf(
+            csr_tensors, suffix_tensors, map_tensors)
+
+        # Packed matrices only keep the pointer arrays next to the encodings,
+        # the index arrays are replaced by empty tensors of the same type.
+        self.packed_tensors = None
+        if packed:
+            self.packed_tensors = staf_cpp.pack_staf(
+                csr_tensors, suffix_tensors, map_tensors)
+            csr_tensors = [csr_tensors[0], csr_tensors[1][:0]]
+            suffix_tensors = [suffix_tensors[0], suffix_tensors[1][:0]]
+            map_tensors = [map_tensors[0], map_tensors[1][:0],
+                           map_tensors[2], map_tensors[3][:0]]
+
+        self.csr_tensors = csr_tensors
+        self.suffix_tensors = suffix_tensors
+        self.map_tensors = map_tensors
+
+    def matmul(self, x, y):
+        """Computes y = A @ x in place. x and y are row-major float32, float16
+        or bfloat16, partial sums are always accumulated in float32."""
+        if self.packed_tensors is not None:
+            staf_cpp.matmul_packed(self.csr_tensors, self.suffix_tensors,
+                                   self.map_tensors, self.packed_tensors,
+                                   x.contiguous(), y, self.n_cols,
+                                   self.schedule)
+            return
+        staf_cpp.matmul(self.csr_tensors, self.suffix_tensors,
+                        self.map_tensors, x.contiguous(), y, self.n_cols,
+                        self.schedule)
+
+    def spgemm(self, b, structure=False):
+        """Computes A @ b for a sparse matrix b with one row per column of A.
+        Every shared pattern is multiplied with b once. Returns a sparse CSR
+        tensor, or with structure=True a binary staf holding the nonzero
+        structure of the product, which shares the patterns of A."""
+        if self.packed_tensors is not None:
+            raise ValueError("spgemm needs the unpacked index arrays")
+        n_rows = self.csr_tensors[0].numel() - 1
+        if b.shape[0] != self.n_cols:
+            raise ValueError("b does not have one row per column of A")
+        b = b.to_sparse_csr()
+        if structure:
+            result = staf_cpp.spgemm_structure(
+                self.csr_tensors, self.suffix_tensors, self.map_tensors,
+                b.crow_indices(), b.col_indices(), b.shape[1], self.n_cols)
+            return staf.from_tensors(*result, n_cols=b.shape[1])
+        row_ptr, col_indices, values = staf_cpp.spgemm(
+            self.csr_tensors, self.suffix_tensors, self.map_tensors,
+            b.crow_indices(), b.col_indices(), b.values(), b.shape[1],
+            self.n_cols)
+        # torch wants both index arrays in the same type
+        if row_ptr.dtype != col_indices.dtype:
+            row_ptr = row_ptr.to(torch.int64)
+            col_indices = col_indices.to(torch.int64)
+        return torch.sparse_csr_tensor(row_ptr, col_indices, values,
+                                       (n_rows, b.shape[1]))
+
+    def propagate(self, x, y, k, alpha=0.0, row_scale=None):
+        """Computes y = H_k in place, where H_0 = x and
+        H_{t+1} = (1 - alpha) * diag(row_scale) @ A @ H_t + alpha * x, in a
+        single call. alpha = 0 gives SGC style powers of A, alpha > 0 APPNP
+        or PageRank style teleports. The matrix must be square and y must not
+        alias x."""
+        staf_cpp.propagate(self.csr_tensors, self.suffix_tensors,
+                           self.map_tensors, x.contiguous(), y, self.n_cols,
+                           k, alpha, row_scale, self.schedule,
+                           self.packed_tensors or [])
+
+    def save_shards(self, prefix, n_shards):
+        """Splits the rows into n_shards ranges holding about the same number
+        of nonzeros and saves every range to
+        f"{prefix}_shard_{k}_of_{n_shards}.pt" as a staf of its own, one at a
+        time. A shard only reads the rows of x in its halo, the columns of A
+        its rows use. Returns the paths, see staf_shard."""
+        if self.packed_tensors is not None:
+            raise ValueError("sharding needs the unpacked index arrays")
+        bounds = staf_cpp.shard_bounds(
+            self.csr_tensors, self.suffix_tensors, self.map_tensors,
+            n_shards).tolist()
+        paths = []
+        for k in range(n_shards):
+            csr_tensors, suffix_tensors, map_tensors, halo = \
+                staf_cpp.shard_staf(self.csr_tensors, self.suffix_tensors,
+                                    self.map_tensors, bounds[k], bounds[k + 1])
+            path = f"{prefix}_shard_{k}_of_{n_shards}.pt"
+            torch.save({"csr": csr_tensors, "suffix": suffix_tensors,
+                        "map": map_tensors, "halo": halo,
+                        "row_begin": bounds[k], "row_end": bounds[k + 1]},
+                       path)
+            paths.append(path)
+        return paths
+
+
+class staf_build():
+    """Handle of a staf build running in the background, see start_build."""
+
+    def __init__(self, handle, packed):
+        self.handle = handle
+        self.packed = packed
+
+    def progress(self):
+        """Fraction of the columns inserted into the forest so far."""
+        return self.handle.progress()
+
+    def memory(self):
+        """Peak and final bytes held by the tries, zero until the forest is
+        built."""
+        return self.handle.memory()
+
+    def cancel(self):
+        """Stops the build at the next column, result() then raises."""
+        self.handle.cancel()
+
+    def done(self):
+        return self.handle.done()
+
+    def wait(self, timeout=None):
+        """Waits at most timeout seconds, forever if None. Returns whether the
+        build has finished."""
+        return self.handle.wait(-1.0 if timeout is None else timeout)
+
+    def result(self, timeout=None):
+        """Returns the built staf, raises TimeoutError if the build does not
+        finish within timeout seconds. The build keeps running after a
+        timeout, so result() can be called again; cancel() stops it. Raises
+        RuntimeError if the build was cancelled."""
+        if not self.wait(timeout):
+            raise TimeoutError("staf build did not finish in time")
+        csr_tensors, suffix_tensors, map_tensors = self.handle.result()
+        a = staf.from_tensors(csr_tensors, suffix_tensors, map_tensors,
+                              packed=self.packed,
+                              n_cols=csr_tensors[0].numel() - 1)
+        a.memory = self.handle.memory()
+        return a
+
+
+def start_build(edge_index, edge_values, l, m, max_memory=0, with_values=True,
+                packed=False, candidates=0, growth_threshold=1.0,
+                retire_after=0):
+    """Starts building a staf on a background thread and returns a staf_build
+    handle right away. The build does not hold the GIL, so the caller can keep
+    serving, e.g. with the plain CSR matrix, until the handle is done."""
+    handle = staf_cpp.start_build(
+        *_csc_arguments(edge_index, edge_values), l, m, max_memory,
+        with_values, candidates, growth_threshold, retire_after)
+    return staf_build(handle, packed)
+
+
+class staf_shard():
+    """The rows [row_begin, row_end) of a staf saved by save_shards, with its
+    columns renumbered to positions in halo. For a square matrix the shard
+    also owns the rows [row_begin, row_end) of x."""
+
+    def __init__(self, path, packed=False):
+        shard = torch.load(path)
+        self.halo = shard["halo"]
+        self.a = staf.from_tensors(shard["csr"], shard["suffix"],
+                                   shard["map"], packed=packed,
+                                   n_cols=self.halo.numel())
+        self.row_begin = shard["row_begin"]
+        self.row_end = shard["row_end"]
+
+    def matmul(self, exchange, y):
+        """Computes the rows [row_begin, row_end) of A @ x into y, reading the
+        halo rows of x from exchange."""
+        self.a.matmul(exchange.gather(self.halo), y)
+
+
+class local_exchange():
+    """Exchange of x between the shards of a square staf within a single
+    process. Every shard publishes the rows of x it owns and gathers the rows
+    of its halo; a multi-process runner sends the same rows between ranks.
+
+        for hop in range(k):
+            for s, x_owned in zip(shards, xs):
+                exchange.publish(s.row_begin, x_owned)
+            for s, y_owned in zip(shards, ys):
+                s.matmul(exchange, y_owned)
+            xs, ys = ys, xs
+    """
+
+    def __init__(self):
+        self.parts = {}
+
+    def publish(self, row_begin, x_owned):
+        # An empty shard shares its row_begin with the next one.
+        if x_owned.size(0) > 0:
+            self.parts[row_begin] = x_owned
+
+    def gather(self, halo):
+        # The halo is sorted, so the rows of every owner are consecutive and
+        # only the rows it needs are copied out of each part.
+        halo = halo.to(torch.int64)
+        begins = sorted(self.parts)
+        owner = torch.searchsorted(torch.tensor(begins), halo, right=True) - 1
+        counts = torch.bincount(owner, minlength=len(begins)).tolist()
+        pieces = []
+        for begin, rows in zip(begins, halo.split(counts)):
+            pieces.append(self.parts[begin].index_select(0, rows - begin))
+        return torch.cat(pieces)
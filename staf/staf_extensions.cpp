@@ -1,49 +1,820 @@
 #include "binary_csr.hpp"
+#include "packed_indices.hpp"
+#include "staf_shard.hpp"
+#include "staf_spgemm.hpp"
+#include "staf_spmm.hpp"
 #include "suffix_forest.hpp"
+#include <chrono>
 #include <cstdint>
+#include <cstring>
+#include <future>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <omp.h>
+#include <stdexcept>
+#include <string>
 #include <torch/extension.h>
 
 #define CHECK_DTYPE(x, dtype)                                                  \
   TORCH_CHECK(x.scalar_type() == dtype,                                        \
               "\"" #x "\" is not a tensor of type \"" #dtype "\"")
 
+#define CHECK_INDEX_DTYPE(x)                                                   \
+  TORCH_CHECK(x.scalar_type() == torch::kInt32 ||                              \
+                  x.scalar_type() == torch::kInt64,                            \
+              "\"" #x "\" is not a tensor of type \"torch::kInt32\" or "       \
+              "\"torch::kInt64\"")
+
+/*---------------------------Helpers-----------------------------------*/
+template <typename T> constexpr torch::ScalarType index_dtype() {
+  return sizeof(T) == sizeof(int64_t) ? torch::kInt64 : torch::kInt32;
+}
+
+template <typename T>
+torch::Tensor copy_to_tensor(const std::vector<T> &v, torch::ScalarType dtype) {
+  torch::Tensor t = torch::empty({static_cast<int64_t>(v.size())}, dtype);
+  std::memcpy(t.data_ptr(), v.data(), v.size() * sizeof(T));
+  return t;
+}
+
+staf_dtype feature_dtype(const torch::Tensor &x) {
+  switch (x.scalar_type()) {
+  case torch::kFloat32:
+    return staf_dtype::float32;
+  case torch::kFloat16:
+    return staf_dtype::float16;
+  case torch::kBFloat16:
+    return staf_dtype::bfloat16;
+  default:
+    TORCH_CHECK(false, "features must be float32, float16 or bfloat16");
+  }
+  return staf_dtype::float32;
+}
+
+// The csr, suffix and map tensors of a STAF matrix.
+using staf_tensors =
+    std::tuple<std::vector<torch::Tensor>, std::vector<torch::Tensor>,
+               std::vector<torch::Tensor>>;
+
+template <typename offset_t, typename index_t>
+staf_tensors
+build_staf(const torch::Tensor &col_ptr, const torch::Tensor &row_idx,
+           const size_t n_rows, const size_t n_cols, const size_t score_lambda,
+           const size_t nr_tries, const size_t max_memory,
+           const bool with_values, const size_t nr_candidates,
+           const double growth_threshold, const size_t retire_after,
+           build_control *control) {
+  constexpr auto offset_dtype = index_dtype<offset_t>();
+  constexpr auto idx_dtype = index_dtype<index_t>();
+
+  offset_t *col_pointers = col_ptr.data_ptr<offset_t>();
+  index_t *row_indices = row_idx.data_ptr<index_t>();
+
+  suffix_forest<offset_t, index_t> forest(nr_tries, score_lambda, max_memory,
+                                          nr_candidates, growth_threshold,
+                                          retire_after);
+  forest.set_control(control);
+  forest.create_forest(col_pointers, row_indices, n_cols);
+  if (control && control->cancelled)
+    throw std::runtime_error("build cancelled");
+  auto binary_csr = forest.build_csr(n_rows, with_values);
+
+  std::vector<torch::Tensor> csr_tensors = {
+      torch::tensor(binary_csr.get_row_ptr(), offset_dtype),
+      torch::tensor(binary_csr.get_col_indices(), idx_dtype)};
+
+  auto [map_suffix_ptr, map_row_index] = binary_csr.get_mapped_rows();
+  auto [row_pattern_ptr, row_pattern_index] = binary_csr.get_row_patterns();
+  std::vector<torch::Tensor> map_tensors = {
+      torch::tensor(map_suffix_ptr, offset_dtype),
+      torch::tensor(map_row_index, idx_dtype),
+      torch::tensor(row_pattern_ptr, offset_dtype),
+      torch::tensor(row_pattern_index, idx_dtype)};
+
+  std::vector<torch::Tensor> packed_suffix_data = {
+      torch::tensor(binary_csr.get_suffix_row_ptr(), offset_dtype),
+      torch::tensor(binary_csr.get_suffix_col_indices(), idx_dtype)};
+
+  if (with_values) {
+    csr_tensors.push_back(
+        torch::tensor(binary_csr.get_data(), torch::kFloat32));
+    packed_suffix_data.push_back(
+        torch::tensor(binary_csr.get_suffix_data(), torch::kFloat32));
+  }
+
+  return std::make_tuple(csr_tensors, packed_suffix_data, map_tensors);
+}
+
 /*---------------------------Main function-----------------------------*/
+void check_build_inputs(const torch::Tensor &col_ptr,
+                        const torch::Tensor &row_idx,
+                        const torch::Tensor &values, const size_t nr_tries) {
+  TORCH_CHECK(nr_tries >= 1, "\"nr_tries\" must be at least 1");
+  CHECK_INDEX_DTYPE(col_ptr);
+  CHECK_INDEX_DTYPE(row_idx);
+  CHECK_DTYPE(values, torch::kFloat32);
+
+  // Offsets must be at least as wide as the indices.
+  if (col_ptr.scalar_type() == torch::kInt32) {
+    CHECK_DTYPE(row_idx, torch::kInt32);
+  }
+}
+
+staf_tensors
+build_dispatch(const torch::Tensor &col_ptr, const torch::Tensor &row_idx,
+               const size_t n_rows, const size_t n_cols,
+               const size_t score_lambda, const size_t nr_tries,
+               const size_t max_memory, const bool with_values,
+               const size_t nr_candidates, const double growth_threshold,
+               const size_t retire_after, build_control *control) {
+  if (col_ptr.scalar_type() == torch::kInt32) {
+    return build_staf<int32_t, int32_t>(
+        col_ptr, row_idx, n_rows, n_cols, score_lambda, nr_tries, max_memory,
+        with_values, nr_candidates, growth_threshold, retire_after, control);
+  }
+  if (row_idx.scalar_type() == torch::kInt32) {
+    return build_staf<int64_t, int32_t>(
+        col_ptr, row_idx, n_rows, n_cols, score_lambda, nr_tries, max_memory,
+        with_values, nr_candidates, growth_threshold, retire_after, control);
+  }
+  return build_staf<int64_t, int64_t>(
+      col_ptr, row_idx, n_rows, n_cols, score_lambda, nr_tries, max_memory,
+      with_values, nr_candidates, growth_threshold, retire_after, control);
+}
+
+// Peak and final memory held by the live tries of a build, in bytes.
+using memory_report = std::map<std::string, int64_t>;
+
+memory_report make_memory_report(const build_control &control) {
+  return {{"peak_memory", control.peak_memory},
+          {"final_memory", control.final_memory}};
+}
+
 std::tuple<std::vector<torch::Tensor>, std::vector<torch::Tensor>,
-           std::vector<torch::Tensor>>
+           std::vector<torch::Tensor>, memory_report>
 init_staf_(const torch::Tensor &col_ptr, const torch::Tensor &row_idx,
            const torch::Tensor &values, const size_t n_rows,
            const size_t n_cols, const size_t score_lambda,
-           const size_t nr_tries) {
+           const size_t nr_tries, const size_t max_memory,
+           const bool with_values, const size_t nr_candidates,
+           const double growth_threshold, const size_t retire_after) {
+  check_build_inputs(col_ptr, row_idx, values, nr_tries);
 
-  CHECK_DTYPE(col_ptr, torch::kInt32);
-  CHECK_DTYPE(row_idx, torch::kInt32);
-  CHECK_DTYPE(values, torch::kFloat32);
+  // The build touches no Python objects, other Python threads keep running.
+  py::gil_scoped_release no_gil;
+  build_control control;
+  auto [csr_tensors, suffix_tensors, map_tensors] = build_dispatch(
+      col_ptr, row_idx, n_rows, n_cols, score_lambda, nr_tries, max_memory,
+      with_values, nr_candidates, growth_threshold, retire_after, &control);
+  return std::make_tuple(csr_tensors, suffix_tensors, map_tensors,
+                         make_memory_report(control));
+}
 
-  int32_t *col_pointers = col_ptr.data_ptr<int32_t>();
-  int32_t *row_indices = row_idx.data_ptr<int32_t>();
-  float *array_of_values = values.data_ptr<float>();
+/*---------------------------Background builds-------------------------*/
+/**
+ * @brief Handle of a build started by start_build. The build runs on a thread
+ * of its own without the GIL; the handle reports its progress, cancels it and
+ * waits for its result. Dropping the handle cancels the build.
+ */
+class staf_build {
+private:
+  std::shared_ptr<build_control> control;
+  std::shared_future<staf_tensors> result_future;
 
-  suffix_forest forest(nr_tries, score_lambda);
-  forest.create_forest(col_pointers, row_indices, n_cols);
-  auto binary_csr = forest.build_csr(n_rows);
+public:
+  staf_build(const torch::Tensor &col_ptr, const torch::Tensor &row_idx,
+             const size_t n_rows, const size_t n_cols,
+             const size_t score_lambda, const size_t nr_tries,
+             const size_t max_memory, const bool with_values,
+             const size_t nr_candidates, const double growth_threshold,
+             const size_t retire_after)
+      : control(std::make_shared<build_control>()) {
+    // The thread holds its own references to the input tensors.
+    result_future =
+        std::async(std::launch::async, [=, control = control]() {
+          return build_dispatch(col_ptr, row_idx, n_rows, n_cols,
+                                score_lambda, nr_tries, max_memory,
+                                with_values, nr_candidates, growth_threshold,
+                                retire_after, control.get());
+        }).share();
+  }
 
-  std::vector<torch::Tensor> csr_tensors = {
-      torch::tensor(binary_csr.get_row_ptr(), torch::kInt32),
-      torch::tensor(binary_csr.get_col_indices(), torch::kInt32),
-      torch::tensor(binary_csr.get_data(), torch::kFloat32)};
+  staf_build(const staf_build &) = delete;
+  staf_build &operator=(const staf_build &) = delete;
+
+  ~staf_build() {
+    control->cancelled = true;
+    py::gil_scoped_release no_gil;
+    result_future.wait();
+  }
+
+  /**
+   * @brief Fraction of the columns inserted into the forest. The CSR arrays
+   * are built after the last column, done() tells when they are ready.
+   */
+  double progress() const {
+    int64_t total = control->columns_total;
+    return total > 0 ? static_cast<double>(control->columns_done) / total
+                     : 0.0;
+  }
+
+  /**
+   * @brief Peak and final memory of the tries, zero until the forest is
+   * built.
+   */
+  memory_report memory() const { return make_memory_report(*control); }
+
+  /**
+   * @brief Stops the build at the next column, result() then throws.
+   */
+  void cancel() { control->cancelled = true; }
+
+  bool done() const {
+    return result_future.wait_for(std::chrono::seconds(0)) ==
+           std::future_status::ready;
+  }
+
+  /**
+   * @brief Waits for the build to finish, at most timeout seconds if the
+   * timeout is not negative.
+   * @return Whether the build has finished.
+   */
+  bool wait(double timeout) {
+    py::gil_scoped_release no_gil;
+    if (timeout < 0) {
+      result_future.wait();
+      return true;
+    }
+    return result_future.wait_for(std::chrono::duration<double>(timeout)) ==
+           std::future_status::ready;
+  }
+
+  /**
+   * @brief Waits for the build and returns the tensors init_staf would have
+   * returned, or throws what the build threw.
+   */
+  staf_tensors result() {
+    wait(-1);
+    return result_future.get();
+  }
+};
 
+std::unique_ptr<staf_build>
+start_build_(const torch::Tensor &col_ptr, const torch::Tensor &row_idx,
+             const torch::Tensor &values, const size_t n_rows,
+             const size_t n_cols, const size_t score_lambda,
+             const size_t nr_tries, const size_t max_memory,
+             const bool with_values, const size_t nr_candidates,
+             const double growth_threshold, const size_t retire_after) {
+  check_build_inputs(col_ptr, row_idx, values, nr_tries);
+  return std::make_unique<staf_build>(
+      col_ptr, row_idx, n_rows, n_cols, score_lambda, nr_tries, max_memory,
+      with_values, nr_candidates, growth_threshold, retire_after);
+}
+
+template <typename offset_t, typename index_t>
+staf_matrix<offset_t, index_t>
+make_staf_matrix(const std::vector<torch::Tensor> &csr_tensors,
+                 const std::vector<torch::Tensor> &suffix_tensors,
+                 const std::vector<torch::Tensor> &map_tensors) {
+  // The index arrays are empty when their packed encodings are used.
+  staf_matrix<offset_t, index_t> a;
+  a.n_rows = csr_tensors[0].numel() - 1;
+  a.row_ptr = csr_tensors[0].data_ptr<offset_t>();
+  a.col_indices = csr_tensors[1].data_ptr<index_t>();
+  a.n_patterns = suffix_tensors[0].numel() - 1;
+  a.suffix_row_ptr = suffix_tensors[0].data_ptr<offset_t>();
+  a.suffix_col_indices = suffix_tensors[1].data_ptr<index_t>();
+  a.map_suffix_ptr = map_tensors[0].data_ptr<offset_t>();
+  a.map_row_index = map_tensors[1].data_ptr<index_t>();
+  a.row_pattern_ptr = map_tensors[2].data_ptr<offset_t>();
+  a.row_pattern_index = map_tensors[3].data_ptr<index_t>();
+  return a;
+}
+
+template <typename offset_t, typename index_t>
+staf_tensors to_staf_tensors(const staf_arrays<offset_t, index_t> &c) {
+  constexpr auto offset_dtype = index_dtype<offset_t>();
+  constexpr auto idx_dtype = index_dtype<index_t>();
+  std::vector<torch::Tensor> csr_tensors = {
+      copy_to_tensor(c.row_ptr, offset_dtype),
+      copy_to_tensor(c.col_indices, idx_dtype)};
+  std::vector<torch::Tensor> suffix_tensors = {
+      copy_to_tensor(c.suffix_row_ptr, offset_dtype),
+      copy_to_tensor(c.suffix_col_indices, idx_dtype)};
   std::vector<torch::Tensor> map_tensors = {
-      torch::tensor(std::get<0>(binary_csr.get_mapped_rows()), torch::kInt32),
-      torch::tensor(std::get<1>(binary_csr.get_mapped_rows()), torch::kInt32)};
+      copy_to_tensor(c.map_suffix_ptr, offset_dtype),
+      copy_to_tensor(c.map_row_index, idx_dtype),
+      copy_to_tensor(c.row_pattern_ptr, offset_dtype),
+      copy_to_tensor(c.row_pattern_index, idx_dtype)};
+  return std::make_tuple(csr_tensors, suffix_tensors, map_tensors);
+}
 
-  std::vector<torch::Tensor> packed_suffix_data = {
-      torch::tensor(binary_csr.get_suffix_row_ptr(), torch::kInt32),
-      torch::tensor(binary_csr.get_suffix_col_indices(), torch::kInt32),
-      torch::tensor(binary_csr.get_suffix_data(), torch::kFloat32)};
+/*---------------------------Index packing-----------------------------*/
+// A packed index array is returned as four tensors: the packed words, the
+// block pointers, the bases and the bit widths. pack_staf returns the
+// encodings of col_indices, suffix_col_indices and row_pattern_index in this
+// order.
+constexpr size_t packed_tensor_count = 3 * 4;
 
-  return std::make_tuple(csr_tensors, packed_suffix_data, map_tensors);
+template <typename offset_t, typename index_t>
+void append_packed(std::vector<torch::Tensor> &out, const offset_t *seg_ptr,
+                   const index_t *values, index_t n_segments) {
+  packed_indices<offset_t, index_t> packed(seg_ptr, values, n_segments);
+  out.push_back(copy_to_tensor(packed.get_words(), torch::kInt32));
+  out.push_back(
+      copy_to_tensor(packed.get_block_ptr(), index_dtype<offset_t>()));
+  out.push_back(copy_to_tensor(packed.get_bases(), index_dtype<index_t>()));
+  out.push_back(copy_to_tensor(packed.get_widths(), torch::kUInt8));
+}
+
+template <typename offset_t, typename index_t>
+std::vector<torch::Tensor>
+pack_indices(const staf_matrix<offset_t, index_t> &a) {
+  std::vector<torch::Tensor> out;
+  append_packed(out, a.row_ptr, a.col_indices, a.n_rows);
+  append_packed(out, a.suffix_row_ptr, a.suffix_col_indices, a.n_patterns);
+  append_packed(out, a.row_pattern_ptr, a.row_pattern_index, a.n_rows);
+  return out;
+}
+
+template <typename offset_t, typename index_t>
+packed_view<offset_t, index_t>
+make_packed_view(const std::vector<torch::Tensor> &packed, size_t first,
+                 const offset_t *seg_ptr) {
+  return {reinterpret_cast<const uint32_t *>(packed[first].data_ptr<int32_t>()),
+          packed[first + 1].data_ptr<offset_t>(), seg_ptr,
+          packed[first + 2].data_ptr<index_t>(),
+          packed[first + 3].data_ptr<uint8_t>()};
+}
+
+template <typename offset_t, typename index_t>
+staf_packed_indices<offset_t, index_t>
+make_staf_packed(const staf_matrix<offset_t, index_t> &a,
+                 const std::vector<torch::Tensor> &packed) {
+  return {make_packed_view<offset_t, index_t>(packed, 0, a.row_ptr),
+          make_packed_view<offset_t, index_t>(packed, 4, a.suffix_row_ptr),
+          make_packed_view<offset_t, index_t>(packed, 8, a.row_pattern_ptr)};
+}
+
+std::vector<torch::Tensor>
+pack_staf_(const std::vector<torch::Tensor> &csr_tensors,
+           const std::vector<torch::Tensor> &suffix_tensors,
+           const std::vector<torch::Tensor> &map_tensors) {
+
+  if (csr_tensors[0].scalar_type() == torch::kInt32) {
+    return pack_indices(make_staf_matrix<int32_t, int32_t>(
+        csr_tensors, suffix_tensors, map_tensors));
+  } else if (csr_tensors[1].scalar_type() == torch::kInt32) {
+    return pack_indices(make_staf_matrix<int64_t, int32_t>(
+        csr_tensors, suffix_tensors, map_tensors));
+  }
+  return pack_indices(make_staf_matrix<int64_t, int64_t>(
+      csr_tensors, suffix_tensors, map_tensors));
+}
+
+/*---------------------------SpMM--------------------------------------*/
+void check_features(const std::vector<torch::Tensor> &csr_tensors,
+                    const torch::Tensor &x, const torch::Tensor &y) {
+  TORCH_CHECK(x.dim() == 2 && y.dim() == 2, "\"x\" and \"y\" must be 2D");
+  TORCH_CHECK(x.is_contiguous() && y.is_contiguous(),
+              "\"x\" and \"y\" must be contiguous");
+  TORCH_CHECK(x.size(1) == y.size(1), "\"x\" and \"y\" widths differ");
+  TORCH_CHECK(y.size(0) == csr_tensors[0].numel() - 1,
+              "\"y\" does not have one row per matrix row");
+}
+
+// n_cols is the number of columns of the matrix, at least its largest column
+// index plus one. The kernels read the rows of x up to it.
+void check_columns(const torch::Tensor &x, int64_t n_cols) {
+  TORCH_CHECK(x.dim() == 2 && x.size(0) >= n_cols,
+              "\"x\" has fewer rows than the matrix has columns");
+}
+
+// Whether bounds rises from 0 to last.
+template <typename index_t>
+bool spans(const index_t *bounds, int64_t size, index_t last) {
+  if (bounds[0] != 0 || bounds[size - 1] != last)
+    return false;
+  for (int64_t k = 0; k + 1 < size; k++) {
+    if (bounds[k] > bounds[k + 1])
+      return false;
+  }
+  return true;
+}
+
+// A schedule of another matrix would make the SpMM read out of bounds.
+template <typename offset_t, typename index_t>
+staf_schedule<offset_t, index_t>
+make_staf_schedule(const staf_matrix<offset_t, index_t> &a,
+                   const std::vector<torch::Tensor> &schedule_tensors) {
+  const torch::Tensor &row_bounds = schedule_tensors[0];
+  const torch::Tensor &pattern_bounds = schedule_tensors[1];
+  TORCH_CHECK(row_bounds.scalar_type() == index_dtype<index_t>() &&
+                  pattern_bounds.scalar_type() == index_dtype<index_t>() &&
+                  row_bounds.is_contiguous() &&
+                  pattern_bounds.is_contiguous() &&
+                  row_bounds.numel() >= 2 &&
+                  row_bounds.numel() == pattern_bounds.numel(),
+              "\"schedule\" is not the output of schedule_staf");
+  const int64_t size = row_bounds.numel();
+  TORCH_CHECK(spans(row_bounds.data_ptr<index_t>(), size, a.n_rows) &&
+                  spans(pattern_bounds.data_ptr<index_t>(), size,
+                        a.n_patterns),
+              "\"schedule\" was computed for another matrix");
+  return {static_cast<index_t>(size - 1), row_bounds.data_ptr<index_t>(),
+          pattern_bounds.data_ptr<index_t>()};
+}
+
+template <typename offset_t, typename index_t>
+void matmul_typed(const std::vector<torch::Tensor> &csr_tensors,
+                  const std::vector<torch::Tensor> &suffix_tensors,
+                  const std::vector<torch::Tensor> &map_tensors,
+                  const std::vector<torch::Tensor> *packed_tensors,
+                  const std::vector<torch::Tensor> &schedule_tensors,
+                  const torch::Tensor &x, torch::Tensor &y, int n_hops,
+                  float alpha, const float *row_scale) {
+  auto a = make_staf_matrix<offset_t, index_t>(csr_tensors, suffix_tensors,
+                                               map_tensors);
+  auto schedule = schedule_tensors.empty()
+                      ? staf_schedule<offset_t, index_t>{}
+                      : make_staf_schedule(a, schedule_tensors);
+  const auto *schedule_ptr = schedule_tensors.empty() ? nullptr : &schedule;
+
+  if (packed_tensors) {
+    staf_propagate(a, make_staf_packed(a, *packed_tensors), x.data_ptr(),
+                   feature_dtype(x), y.data_ptr(), feature_dtype(y),
+                   x.size(1), n_hops, alpha, row_scale, schedule_ptr);
+  } else {
+    staf_propagate(a, x.data_ptr(), feature_dtype(x), y.data_ptr(),
+                   feature_dtype(y), x.size(1), n_hops, alpha, row_scale,
+                   schedule_ptr);
+  }
+}
+
+void matmul_dispatch(const std::vector<torch::Tensor> &csr_tensors,
+                     const std::vector<torch::Tensor> &suffix_tensors,
+                     const std::vector<torch::Tensor> &map_tensors,
+                     const std::vector<torch::Tensor> *packed_tensors,
+                     const std::vector<torch::Tensor> &schedule_tensors,
+                     const torch::Tensor &x, torch::Tensor &y,
+                     int n_hops = 1, float alpha = 0.0f,
+                     const float *row_scale = nullptr) {
+  check_features(csr_tensors, x, y);
+  TORCH_CHECK(schedule_tensors.empty() || schedule_tensors.size() == 2,
+              "\"schedule\" is not the output of schedule_staf");
+
+  if (csr_tensors[0].scalar_type() == torch::kInt32) {
+    matmul_typed<int32_t, int32_t>(csr_tensors, suffix_tensors, map_tensors,
+                                   packed_tensors, schedule_tensors, x, y,
+                                   n_hops, alpha, row_scale);
+  } else if (csr_tensors[1].scalar_type() == torch::kInt32) {
+    matmul_typed<int64_t, int32_t>(csr_tensors, suffix_tensors, map_tensors,
+                                   packed_tensors, schedule_tensors, x, y,
+                                   n_hops, alpha, row_scale);
+  } else {
+    matmul_typed<int64_t, int64_t>(csr_tensors, suffix_tensors, map_tensors,
+                                   packed_tensors, schedule_tensors, x, y,
+                                   n_hops, alpha, row_scale);
+  }
+}
+
+void staf_matmul_(const std::vector<torch::Tensor> &csr_tensors,
+                  const std::vector<torch::Tensor> &suffix_tensors,
+                  const std::vector<torch::Tensor> &map_tensors,
+                  const torch::Tensor &x, torch::Tensor &y, int64_t n_cols,
+                  const std::vector<torch::Tensor> &schedule_tensors) {
+  check_columns(x, n_cols);
+  matmul_dispatch(csr_tensors, suffix_tensors, map_tensors, nullptr,
+                  schedule_tensors, x, y);
+}
+
+void staf_matmul_packed_(const std::vector<torch::Tensor> &csr_tensors,
+                         const std::vector<torch::Tensor> &suffix_tensors,
+                         const std::vector<torch::Tensor> &map_tensors,
+                         const std::vector<torch::Tensor> &packed_tensors,
+                         const torch::Tensor &x, torch::Tensor &y,
+                         int64_t n_cols,
+                         const std::vector<torch::Tensor> &schedule_tensors) {
+  TORCH_CHECK(packed_tensors.size() == packed_tensor_count,
+              "\"packed_tensors\" is not the output of pack_staf");
+  check_columns(x, n_cols);
+  matmul_dispatch(csr_tensors, suffix_tensors, map_tensors, &packed_tensors,
+                  schedule_tensors, x, y);
+}
+
+void staf_propagate_(const std::vector<torch::Tensor> &csr_tensors,
+                     const std::vector<torch::Tensor> &suffix_tensors,
+                     const std::vector<torch::Tensor> &map_tensors,
+                     const torch::Tensor &x, torch::Tensor &y, int64_t n_cols,
+                     int64_t n_hops, double alpha,
+                     const c10::optional<torch::Tensor> &row_scale,
+                     const std::vector<torch::Tensor> &schedule_tensors,
+                     const std::vector<torch::Tensor> &packed_tensors) {
+  TORCH_CHECK(n_hops >= 1, "\"n_hops\" must be at least 1");
+  check_columns(x, n_cols);
+  TORCH_CHECK(x.size(0) == csr_tensors[0].numel() - 1,
+              "propagation needs a square matrix, \"x\" does not have one "
+              "row per matrix row");
+  TORCH_CHECK(x.data_ptr() != y.data_ptr(), "\"x\" and \"y\" must not alias");
+  TORCH_CHECK(packed_tensors.empty() ||
+                  packed_tensors.size() == packed_tensor_count,
+              "\"packed_tensors\" is not the output of pack_staf");
+
+  const float *scale = nullptr;
+  if (row_scale) {
+    TORCH_CHECK(row_scale->scalar_type() == torch::kFloat32 &&
+                    row_scale->is_contiguous() &&
+                    row_scale->numel() == csr_tensors[0].numel() - 1,
+                "\"row_scale\" must be a float32 tensor with one factor per "
+                "matrix row");
+    scale = row_scale->data_ptr<float>();
+  }
+  matmul_dispatch(csr_tensors, suffix_tensors, map_tensors,
+                  packed_tensors.empty() ? nullptr : &packed_tensors,
+                  schedule_tensors, x, y, static_cast<int>(n_hops),
+                  static_cast<float>(alpha), scale);
 }
 
-PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) { m.def("init_staf", &init_staf_); }
+/*---------------------------SpGEMM------------------------------------*/
+// B is converted to the offset and index types of A.
+template <typename offset_t, typename index_t> struct csr_operand {
+  torch::Tensor row_ptr, col_indices, values;
+  csr_view<offset_t, index_t> view;
+
+  csr_operand(const torch::Tensor &b_row_ptr,
+              const torch::Tensor &b_col_indices,
+              const c10::optional<torch::Tensor> &b_values, int64_t n_cols)
+      : row_ptr(b_row_ptr.to(index_dtype<offset_t>()).contiguous()),
+        col_indices(b_col_indices.to(index_dtype<index_t>()).contiguous()) {
+    if (b_values)
+      values = b_values->to(torch::kFloat32).contiguous();
+    view = {static_cast<index_t>(row_ptr.numel() - 1),
+            static_cast<index_t>(n_cols), row_ptr.data_ptr<offset_t>(),
+            col_indices.data_ptr<index_t>(),
+            b_values ? values.data_ptr<float>() : nullptr};
+  }
+};
+
+template <typename offset_t, typename index_t>
+std::vector<torch::Tensor>
+spgemm_typed(const staf_matrix<offset_t, index_t> &a,
+             const csr_operand<offset_t, index_t> &b) {
+  auto c = staf_spgemm(a, b.view);
+  return {copy_to_tensor(c.row_ptr, index_dtype<offset_t>()),
+          copy_to_tensor(c.col_indices, index_dtype<index_t>()),
+          copy_to_tensor(c.values, torch::kFloat32)};
+}
+
+template <typename offset_t, typename index_t>
+staf_tensors
+spgemm_structure_typed(const staf_matrix<offset_t, index_t> &a,
+                       const csr_operand<offset_t, index_t> &b) {
+  return to_staf_tensors(staf_spgemm_structure(a, b.view));
+}
+
+// n_cols is the number of columns of A, as in check_columns. B needs a row
+// for each of them and columns below b_n_cols, the size of the accumulator.
+void check_spgemm_operand(const torch::Tensor &b_row_ptr,
+                          const torch::Tensor &b_col_indices,
+                          const c10::optional<torch::Tensor> &b_values,
+                          int64_t b_n_cols, int64_t n_cols) {
+  CHECK_INDEX_DTYPE(b_row_ptr);
+  CHECK_INDEX_DTYPE(b_col_indices);
+  TORCH_CHECK(b_row_ptr.dim() == 1 && b_row_ptr.numel() - 1 >= n_cols,
+              "\"b_row_ptr\" has fewer rows than A has columns");
+  TORCH_CHECK(b_row_ptr[0].item<int64_t>() == 0 &&
+                  b_row_ptr[-1].item<int64_t>() == b_col_indices.numel(),
+              "\"b_row_ptr\" does not match \"b_col_indices\"");
+  TORCH_CHECK(b_col_indices.numel() == 0 ||
+                  (b_col_indices.min().item<int64_t>() >= 0 &&
+                   b_col_indices.max().item<int64_t>() < b_n_cols),
+              "\"b_col_indices\" must be below \"b_n_cols\"");
+  TORCH_CHECK(!b_values || b_values->numel() == b_col_indices.numel(),
+              "\"b_values\" must hold one value per entry of B");
+}
+
+std::vector<torch::Tensor>
+staf_spgemm_(const std::vector<torch::Tensor> &csr_tensors,
+             const std::vector<torch::Tensor> &suffix_tensors,
+             const std::vector<torch::Tensor> &map_tensors,
+             const torch::Tensor &b_row_ptr, const torch::Tensor &b_col_indices,
+             const c10::optional<torch::Tensor> &b_values, int64_t b_n_cols,
+             int64_t n_cols) {
+  check_spgemm_operand(b_row_ptr, b_col_indices, b_values, b_n_cols, n_cols);
+  if (csr_tensors[0].scalar_type() == torch::kInt32) {
+    return spgemm_typed(make_staf_matrix<int32_t, int32_t>(
+                            csr_tensors, suffix_tensors, map_tensors),
+                        csr_operand<int32_t, int32_t>(
+                            b_row_ptr, b_col_indices, b_values, b_n_cols));
+  } else if (csr_tensors[1].scalar_type() == torch::kInt32) {
+    return spgemm_typed(make_staf_matrix<int64_t, int32_t>(
+                            csr_tensors, suffix_tensors, map_tensors),
+                        csr_operand<int64_t, int32_t>(
+                            b_row_ptr, b_col_indices, b_values, b_n_cols));
+  }
+  return spgemm_typed(make_staf_matrix<int64_t, int64_t>(
+                          csr_tensors, suffix_tensors, map_tensors),
+                      csr_operand<int64_t, int64_t>(b_row_ptr, b_col_indices,
+                                                    b_values, b_n_cols));
+}
+
+staf_tensors
+staf_spgemm_structure_(const std::vector<torch::Tensor> &csr_tensors,
+                       const std::vector<torch::Tensor> &suffix_tensors,
+                       const std::vector<torch::Tensor> &map_tensors,
+                       const torch::Tensor &b_row_ptr,
+                       const torch::Tensor &b_col_indices, int64_t b_n_cols,
+                       int64_t n_cols) {
+  check_spgemm_operand(b_row_ptr, b_col_indices, c10::nullopt, b_n_cols,
+                       n_cols);
+  if (csr_tensors[0].scalar_type() == torch::kInt32) {
+    return spgemm_structure_typed(
+        make_staf_matrix<int32_t, int32_t>(csr_tensors, suffix_tensors,
+                                           map_tensors),
+        csr_operand<int32_t, int32_t>(b_row_ptr, b_col_indices, c10::nullopt,
+                                      b_n_cols));
+  } else if (csr_tensors[1].scalar_type() == torch::kInt32) {
+    return spgemm_structure_typed(
+        make_staf_matrix<int64_t, int32_t>(csr_tensors, suffix_tensors,
+                                           map_tensors),
+        csr_operand<int64_t, int32_t>(b_row_ptr, b_col_indices, c10::nullopt,
+                                      b_n_cols));
+  }
+  return spgemm_structure_typed(
+      make_staf_matrix<int64_t, int64_t>(csr_tensors, suffix_tensors,
+                                         map_tensors),
+      csr_operand<int64_t, int64_t>(b_row_ptr, b_col_indices, c10::nullopt,
+                                    b_n_cols));
+}
+
+/*---------------------------Scheduling--------------------------------*/
+template <typename offset_t, typename index_t>
+std::vector<torch::Tensor>
+schedule_typed(const staf_matrix<offset_t, index_t> &a, index_t n_parts) {
+  torch::Tensor row_bounds =
+      torch::empty({n_parts + 1}, index_dtype<index_t>());
+  torch::Tensor pattern_bounds =
+      torch::empty({n_parts + 1}, index_dtype<index_t>());
+  staf_make_schedule(a, n_parts, row_bounds.data_ptr<index_t>(),
+                     pattern_bounds.data_ptr<index_t>());
+  return {row_bounds, pattern_bounds};
+}
+
+std::vector<torch::Tensor>
+schedule_staf_(const std::vector<torch::Tensor> &csr_tensors,
+               const std::vector<torch::Tensor> &suffix_tensors,
+               const std::vector<torch::Tensor> &map_tensors,
+               int64_t n_parts) {
+  if (n_parts <= 0)
+    n_parts = omp_get_max_threads();
+
+  if (csr_tensors[0].scalar_type() == torch::kInt32) {
+    return schedule_typed(make_staf_matrix<int32_t, int32_t>(
+                              csr_tensors, suffix_tensors, map_tensors),
+                          static_cast<int32_t>(n_parts));
+  } else if (csr_tensors[1].scalar_type() == torch::kInt32) {
+    return schedule_typed(make_staf_matrix<int64_t, int32_t>(
+                              csr_tensors, suffix_tensors, map_tensors),
+                          static_cast<int32_t>(n_parts));
+  }
+  return schedule_typed(make_staf_matrix<int64_t, int64_t>(
+                            csr_tensors, suffix_tensors, map_tensors),
+                        n_parts);
+}
+
+/*---------------------------Sharding----------------------------------*/
+template <typename offset_t, typename index_t>
+torch::Tensor shard_bounds_typed(const staf_matrix<offset_t, index_t> &a,
+                                 index_t n_shards) {
+  torch::Tensor row_bounds =
+      torch::empty({n_shards + 1}, index_dtype<index_t>());
+  staf_shard_bounds(a, n_shards, row_bounds.data_ptr<index_t>());
+  return row_bounds;
+}
+
+template <typename offset_t, typename index_t>
+std::tuple<std::vector<torch::Tensor>, std::vector<torch::Tensor>,
+           std::vector<torch::Tensor>, torch::Tensor>
+shard_typed(const staf_matrix<offset_t, index_t> &a, index_t row_begin,
+            index_t row_end) {
+  std::vector<index_t> halo;
+  auto [csr_tensors, suffix_tensors, map_tensors] =
+      to_staf_tensors(staf_shard(a, row_begin, row_end, halo));
+  return std::make_tuple(csr_tensors, suffix_tensors, map_tensors,
+                         copy_to_tensor(halo, index_dtype<index_t>()));
+}
+
+// Sharding reads the index arrays, which are empty when packed.
+void check_shard_input(const std::vector<torch::Tensor> &csr_tensors,
+                       const std::vector<torch::Tensor> &suffix_tensors,
+                       const std::vector<torch::Tensor> &map_tensors) {
+  TORCH_CHECK(csr_tensors[1].numel() == csr_tensors[0][-1].item<int64_t>() &&
+                  suffix_tensors[1].numel() ==
+                      suffix_tensors[0][-1].item<int64_t>() &&
+                  map_tensors[3].numel() == map_tensors[2][-1].item<int64_t>(),
+              "sharding needs the unpacked index arrays");
+}
+
+torch::Tensor shard_bounds_(const std::vector<torch::Tensor> &csr_tensors,
+                            const std::vector<torch::Tensor> &suffix_tensors,
+                            const std::vector<torch::Tensor> &map_tensors,
+                            int64_t n_shards) {
+  TORCH_CHECK(n_shards >= 1, "\"n_shards\" must be at least 1");
+  check_shard_input(csr_tensors, suffix_tensors, map_tensors);
+  if (csr_tensors[0].scalar_type() == torch::kInt32) {
+    return shard_bounds_typed(make_staf_matrix<int32_t, int32_t>(
+                                  csr_tensors, suffix_tensors, map_tensors),
+                              static_cast<int32_t>(n_shards));
+  } else if (csr_tensors[1].scalar_type() == torch::kInt32) {
+    return shard_bounds_typed(make_staf_matrix<int64_t, int32_t>(
+                                  csr_tensors, suffix_tensors, map_tensors),
+                              static_cast<int32_t>(n_shards));
+  }
+  return shard_bounds_typed(make_staf_matrix<int64_t, int64_t>(
+                                csr_tensors, suffix_tensors, map_tensors),
+                            n_shards);
+}
+
+std::tuple<std::vector<torch::Tensor>, std::vector<torch::Tensor>,
+           std::vector<torch::Tensor>, torch::Tensor>
+shard_staf_(const std::vector<torch::Tensor> &csr_tensors,
+            const std::vector<torch::Tensor> &suffix_tensors,
+            const std::vector<torch::Tensor> &map_tensors, int64_t row_begin,
+            int64_t row_end) {
+  check_shard_input(csr_tensors, suffix_tensors, map_tensors);
+  TORCH_CHECK(0 <= row_begin && row_begin <= row_end &&
+                  row_end < csr_tensors[0].numel(),
+              "the row range is out of bounds");
+  if (csr_tensors[0].scalar_type() == torch::kInt32) {
+    return shard_typed(make_staf_matrix<int32_t, int32_t>(
+                           csr_tensors, suffix_tensors, map_tensors),
+                       static_cast<int32_t>(row_begin),
+                       static_cast<int32_t>(row_end));
+  } else if (csr_tensors[1].scalar_type() == torch::kInt32) {
+    return shard_typed(make_staf_matrix<int64_t, int32_t>(
+                           csr_tensors, suffix_tensors, map_tensors),
+                       static_cast<int32_t>(row_begin),
+                       static_cast<int32_t>(row_end));
+  }
+  return shard_typed(make_staf_matrix<int64_t, int64_t>(
+                         csr_tensors, suffix_tensors, map_tensors),
+                     row_begin, row_end);
+}
+
+PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
+  m.def("init_staf", &init_staf_, py::arg("col_ptr"), py::arg("row_idx"),
+        py::arg("values"), py::arg("n_rows"), py::arg("n_cols"),
+        py::arg("score_lambda"), py::arg("nr_tries"),
+        py::arg("max_memory") = 0, py::arg("with_values") = true,
+        py::arg("nr_candidates") = 0, py::arg("growth_threshold") = 1.0,
+        py::arg("retire_after") = 0);
+  m.def("start_build", &start_build_, py::arg("col_ptr"), py::arg("row_idx"),
+        py::arg("values"), py::arg("n_rows"), py::arg("n_cols"),
+        py::arg("score_lambda"), py::arg("nr_tries"),
+        py::arg("max_memory") = 0, py::arg("with_values") = true,
+        py::arg("nr_candidates") = 0, py::arg("growth_threshold") = 1.0,
+        py::arg("retire_after") = 0);
+  py::class_<staf_build>(m, "staf_build")
+      .def("progress", &staf_build::progress)
+      .def("memory", &staf_build::memory)
+      .def("cancel", &staf_build::cancel)
+      .def("done", &staf_build::done)
+      .def("wait", &staf_build::wait, py::arg("timeout") = -1.0)
+      .def("result", &staf_build::result);
+  m.def("matmul", &staf_matmul_, py::arg("csr_tensors"),
+        py::arg("suffix_tensors"), py::arg("map_tensors"), py::arg("x"),
+        py::arg("y"), py::arg("n_cols"),
+        py::arg("schedule") = std::vector<torch::Tensor>());
+  m.def("pack_staf", &pack_staf_, py::arg("csr_tensors"),
+        py::arg("suffix_tensors"), py::arg("map_tensors"));
+  m.def("matmul_packed", &staf_matmul_packed_, py::arg("csr_tensors"),
+        py::arg("suffix_tensors"), py::arg("map_tensors"),
+        py::arg("packed_tensors"), py::arg("x"), py::arg("y"),
+        py::arg("n_cols"), py::arg("schedule") = std::vector<torch::Tensor>());
+  m.def("propagate", &staf_propagate_, py::arg("csr_tensors"),
+        py::arg("suffix_tensors"), py::arg("map_tensors"), py::arg("x"),
+        py::arg("y"), py::arg("n_cols"), py::arg("n_hops"),
+        py::arg("alpha") = 0.0,
+        py::arg("row_scale") = py::none(),
+        py::arg("schedule") = std::vector<torch::Tensor>(),
+        py::arg("packed_tensors") = std::vector<torch::Tensor>());
+  m.def("spgemm", &staf_spgemm_, py::arg("csr_tensors"),
+        py::arg("suffix_tensors"), py::arg("map_tensors"),
+        py::arg("b_row_ptr"), py::arg("b_col_indices"), py::arg("b_values"),
+        py::arg("b_n_cols"), py::arg("n_cols"));
+  m.def("spgemm_structure", &staf_spgemm_structure_, py::arg("csr_tensors"),
+        py::arg("suffix_tensors"), py::arg("map_tensors"),
+        py::arg("b_row_ptr"), py::arg("b_col_indices"), py::arg("b_n_cols"),
+        py::arg("n_cols"));
+  m.def("schedule_staf", &schedule_staf_, py::arg("csr_tensors"),
+        py::arg("suffix_tensors"), py::arg("map_tensors"),
+        py::arg("n_parts") = 0);
+  m.def("shard_bounds", &shard_bounds_, py::arg("csr_tensors"),
+        py::arg("suffix_tensors"), py::arg("map_tensors"),
+        py::arg("n_shards"));
+  m.def("shard_staf", &shard_staf_, py::arg("csr_tensors"),
+        py::arg("suffix_tensors"), py::arg("map_tensors"),
+        py::arg("row_begin"), py::arg("row_end"));
+}
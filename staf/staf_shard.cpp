@@ -0,0 +1,108 @@
+#include "staf_shard.hpp"
+#include <algorithm>
+
+namespace {
+/**
+ * @brief Sorts values and removes duplicates.
+ */
+template <typename index_t> void sort_unique(std::vector<index_t> &values) {
+  std::sort(values.begin(), values.end());
+  values.erase(std::unique(values.begin(), values.end()), values.end());
+}
+
+/**
+ * @brief Position of value in the sorted, duplicate free vector values.
+ */
+template <typename index_t>
+index_t position(const std::vector<index_t> &values, index_t value) {
+  return std::lower_bound(values.begin(), values.end(), value) -
+         values.begin();
+}
+} // namespace
+
+template <typename offset_t, typename index_t>
+void staf_shard_bounds(const staf_matrix<offset_t, index_t> &a,
+                       index_t n_shards, index_t *row_bounds) {
+  // nonzeros[row] counts the nonzeros of the rows before row.
+  std::vector<int64_t> nonzeros(a.n_rows + 1, 0);
+  for (index_t row = 0; row < a.n_rows; row++) {
+    int64_t count = a.row_ptr[row + 1] - a.row_ptr[row];
+    for (offset_t m = a.row_pattern_ptr[row]; m < a.row_pattern_ptr[row + 1];
+         m++) {
+      index_t p = a.row_pattern_index[m];
+      count += a.suffix_row_ptr[p + 1] - a.suffix_row_ptr[p];
+    }
+    nonzeros[row + 1] = nonzeros[row] + count;
+  }
+
+  for (index_t k = 0; k <= n_shards; k++) {
+    const int64_t target = nonzeros[a.n_rows] * k / n_shards;
+    row_bounds[k] =
+        std::lower_bound(nonzeros.begin(), nonzeros.end(), target) -
+        nonzeros.begin();
+  }
+  // Rows without nonzeros at the end belong to the last shard.
+  row_bounds[n_shards] = a.n_rows;
+}
+
+template <typename offset_t, typename index_t>
+staf_arrays<offset_t, index_t>
+staf_shard(const staf_matrix<offset_t, index_t> &a, index_t row_begin,
+           index_t row_end, std::vector<index_t> &halo) {
+  staf_arrays<offset_t, index_t> s;
+  s.n_rows = row_end - row_begin;
+  const offset_t unique_begin = a.row_ptr[row_begin];
+  const offset_t unique_end = a.row_ptr[row_end];
+  const offset_t patterns_begin = a.row_pattern_ptr[row_begin];
+  const offset_t patterns_end = a.row_pattern_ptr[row_end];
+
+  // Patterns used by the rows of the shard.
+  std::vector<index_t> patterns(a.row_pattern_index + patterns_begin,
+                                a.row_pattern_index + patterns_end);
+  sort_unique(patterns);
+
+  // Halo: every column of A a row of the shard reads.
+  halo.assign(a.col_indices + unique_begin, a.col_indices + unique_end);
+  for (index_t p : patterns)
+    halo.insert(halo.end(), a.suffix_col_indices + a.suffix_row_ptr[p],
+                a.suffix_col_indices + a.suffix_row_ptr[p + 1]);
+  sort_unique(halo);
+
+  // Both renumberings keep the order, sorted segments stay sorted.
+  for (index_t row = row_begin; row <= row_end; row++) {
+    s.row_ptr.push_back(a.row_ptr[row] - unique_begin);
+    s.row_pattern_ptr.push_back(a.row_pattern_ptr[row] - patterns_begin);
+  }
+  s.col_indices.reserve(unique_end - unique_begin);
+  for (offset_t k = unique_begin; k < unique_end; k++)
+    s.col_indices.push_back(position(halo, a.col_indices[k]));
+  s.row_pattern_index.reserve(patterns_end - patterns_begin);
+  for (offset_t m = patterns_begin; m < patterns_end; m++)
+    s.row_pattern_index.push_back(position(patterns, a.row_pattern_index[m]));
+
+  s.suffix_row_ptr.push_back(0);
+  for (index_t p : patterns) {
+    for (offset_t k = a.suffix_row_ptr[p]; k < a.suffix_row_ptr[p + 1]; k++)
+      s.suffix_col_indices.push_back(position(halo, a.suffix_col_indices[k]));
+    s.suffix_row_ptr.push_back(s.suffix_col_indices.size());
+  }
+
+  s.build_map();
+  return s;
+}
+
+template void staf_shard_bounds(const staf_matrix<int32_t, int32_t> &,
+                                int32_t, int32_t *);
+template void staf_shard_bounds(const staf_matrix<int64_t, int32_t> &,
+                                int32_t, int32_t *);
+template void staf_shard_bounds(const staf_matrix<int64_t, int64_t> &,
+                                int64_t, int64_t *);
+template staf_arrays<int32_t, int32_t>
+staf_shard(const staf_matrix<int32_t, int32_t> &, int32_t, int32_t,
+           std::vector<int32_t> &);
+template staf_arrays<int64_t, int32_t>
+staf_shard(const staf_matrix<int64_t, int32_t> &, int32_t, int32_t,
+           std::vector<int32_t> &);
+template staf_arrays<int64_t, int64_t>
+staf_shard(const staf_matrix<int64_t, int64_t> &, int64_t, int64_t,
+           std::vector<int64_t> &);
@@ -0,0 +1,43 @@
+#ifndef STAF_SHARD_HPP
+#define STAF_SHARD_HPP
+
+#include "staf_spmm.hpp"
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief Splits the rows of a STAF matrix into n_shards consecutive ranges
+ * holding about the same number of nonzeros, counting every pattern once for
+ * each of its rows.
+ *
+ * @param a The STAF matrix.
+ * @param n_shards Number of shards.
+ * @param row_bounds Output, n_shards + 1 entries. Shard k holds the rows
+ * [row_bounds[k], row_bounds[k + 1]).
+ */
+template <typename offset_t, typename index_t>
+void staf_shard_bounds(const staf_matrix<offset_t, index_t> &a,
+                       index_t n_shards, index_t *row_bounds);
+
+/**
+ * @brief Extracts the rows [row_begin, row_end) of a STAF matrix as a
+ * self-contained STAF matrix.
+ *
+ * The shard keeps the shared patterns its rows use, in their original order.
+ * Its columns are renumbered to positions in the halo, the sorted columns of
+ * A the rows of the shard read, so a worker only needs the rows of X listed in
+ * the halo: rows [row_begin, row_end) of A * X equal the shard times
+ * X[halo].
+ *
+ * @param a The STAF matrix.
+ * @param row_begin First row of the shard.
+ * @param row_end One past the last row of the shard.
+ * @param halo Output, the columns of A read by the shard in ascending order.
+ * @return The shard.
+ */
+template <typename offset_t, typename index_t>
+staf_arrays<offset_t, index_t>
+staf_shard(const staf_matrix<offset_t, index_t> &a, index_t row_begin,
+           index_t row_end, std::vector<index_t> &halo);
+
+#endif
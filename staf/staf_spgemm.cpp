@@ -0,0 +1,343 @@
+#include "staf_spgemm.hpp"
+#include <algorithm>
+#include <numeric>
+#include <omp.h>
+
+namespace {
+/**
+ * @brief Dense accumulator of one sparse row with n_cols columns. Columns are
+ * recorded in the order they are first touched, a stamp per column tells
+ * whether it was touched since the last clear, so clearing is free.
+ */
+template <typename index_t> struct sparse_accumulator {
+  std::vector<float> values;
+  std::vector<uint32_t> stamps;
+  std::vector<index_t> touched;
+  uint32_t stamp = 1;
+
+  explicit sparse_accumulator(index_t n_cols)
+      : values(n_cols), stamps(n_cols, 0) {}
+
+  void clear() {
+    touched.clear();
+    if (++stamp == 0) {
+      std::fill(stamps.begin(), stamps.end(), 0);
+      stamp = 1;
+    }
+  }
+
+  bool contains(index_t col) const { return stamps[col] == stamp; }
+
+  void add(index_t col, float value) {
+    if (stamps[col] != stamp) {
+      stamps[col] = stamp;
+      values[col] = value;
+      touched.push_back(col);
+    } else {
+      values[col] += value;
+    }
+  }
+};
+
+/**
+ * @brief Adds row `row` of B to the accumulator.
+ */
+template <typename offset_t, typename index_t>
+void add_b_row(const csr_view<offset_t, index_t> &b, index_t row,
+               sparse_accumulator<index_t> &acc) {
+  for (offset_t k = b.row_ptr[row]; k < b.row_ptr[row + 1]; k++)
+    acc.add(b.col_indices[k], b.values ? b.values[k] : 1.0f);
+}
+
+/**
+ * @brief Number of entries of B in the rows selected by cols[start, end).
+ */
+template <typename offset_t, typename index_t>
+int64_t b_entries(const csr_view<offset_t, index_t> &b, const index_t *cols,
+                  offset_t start, offset_t end) {
+  int64_t entries = 0;
+  for (offset_t k = start; k < end; k++)
+    entries += b.row_ptr[cols[k] + 1] - b.row_ptr[cols[k]];
+  return entries;
+}
+
+/**
+ * @brief Output of one part of a row_builder.
+ */
+template <typename index_t> struct row_fragment {
+  std::vector<index_t> cols;
+  std::vector<float> values;
+  std::vector<index_t> patterns;
+};
+
+/**
+ * @brief Sorts the columns touched since position first and appends them to
+ * the fragment, with their values if requested.
+ */
+template <typename index_t>
+void append_sorted(sparse_accumulator<index_t> &acc, size_t first,
+                   row_fragment<index_t> &out, bool with_values) {
+  std::sort(acc.touched.begin() + first, acc.touched.end());
+  for (size_t i = first; i < acc.touched.size(); i++) {
+    out.cols.push_back(acc.touched[i]);
+    if (with_values)
+      out.values.push_back(acc.values[acc.touched[i]]);
+  }
+}
+
+/**
+ * @brief Computes n sparse rows in consecutive parts of equal cost, each into
+ * a fragment of its own, and concatenates the fragments into CSR arrays.
+ * Besides its columns and values, a row may list the shared patterns it
+ * keeps, which are concatenated alike.
+ */
+template <typename offset_t, typename index_t> struct row_builder {
+  index_t n;
+  std::vector<int64_t> cost;
+  std::vector<index_t> bounds;
+  std::vector<row_fragment<index_t>> parts;
+  std::vector<offset_t> ptr, pattern_ptr;
+  std::vector<index_t> cols, patterns;
+  std::vector<float> values;
+
+  row_builder(index_t n, index_t n_parts)
+      : n(n), cost(n + 1), bounds(n_parts + 1), parts(n_parts), ptr(n + 1),
+        pattern_ptr(n + 1) {}
+
+  /**
+   * @brief Builds the rows, must be called by every thread of the team.
+   * row_cost(i) estimates the work of row i, emit(i, fragment) appends row i
+   * to a fragment.
+   */
+  template <typename cost_fn, typename emit_fn>
+  void run(const cost_fn &row_cost, const emit_fn &emit) {
+    const index_t n_parts = parts.size();
+
+#pragma omp for
+    for (index_t i = 0; i < n; i++)
+      cost[i + 1] = row_cost(i) + 1;
+
+#pragma omp single
+    {
+      std::partial_sum(cost.begin(), cost.end(), cost.begin());
+      for (index_t k = 0; k <= n_parts; k++)
+        bounds[k] = std::lower_bound(cost.begin(), cost.end(),
+                                     cost[n] * k / n_parts) -
+                    cost.begin();
+    }
+
+#pragma omp for schedule(static, 1)
+    for (index_t k = 0; k < n_parts; k++) {
+      row_fragment<index_t> &part = parts[k];
+      for (index_t i = bounds[k]; i < bounds[k + 1]; i++) {
+        size_t n_cols = part.cols.size();
+        size_t n_patterns = part.patterns.size();
+        emit(i, part);
+        ptr[i + 1] = part.cols.size() - n_cols;
+        pattern_ptr[i + 1] = part.patterns.size() - n_patterns;
+      }
+    }
+
+#pragma omp single
+    {
+      std::partial_sum(ptr.begin(), ptr.end(), ptr.begin());
+      std::partial_sum(pattern_ptr.begin(), pattern_ptr.end(),
+                       pattern_ptr.begin());
+      bool with_values = std::any_of(parts.begin(), parts.end(),
+                                     [](const row_fragment<index_t> &part) {
+                                       return !part.values.empty();
+                                     });
+      cols.resize(ptr[n]);
+      values.resize(with_values ? ptr[n] : 0);
+      patterns.resize(pattern_ptr[n]);
+    }
+
+#pragma omp for schedule(static, 1)
+    for (index_t k = 0; k < n_parts; k++) {
+      row_fragment<index_t> &part = parts[k];
+      std::copy(part.cols.begin(), part.cols.end(),
+                cols.begin() + ptr[bounds[k]]);
+      // Structure-only builds leave values empty.
+      if (!values.empty())
+        std::copy(part.values.begin(), part.values.end(),
+                  values.begin() + ptr[bounds[k]]);
+      std::copy(part.patterns.begin(), part.patterns.end(),
+                patterns.begin() + pattern_ptr[bounds[k]]);
+      part = row_fragment<index_t>();
+    }
+  }
+};
+
+/**
+ * @brief Computes the product of every shared pattern with B into products.
+ * Must be called by every thread of the team.
+ */
+template <typename offset_t, typename index_t>
+void pattern_products(const staf_matrix<offset_t, index_t> &a,
+                      const csr_view<offset_t, index_t> &b,
+                      sparse_accumulator<index_t> &acc, bool with_values,
+                      row_builder<offset_t, index_t> &products) {
+  products.run(
+      [&](index_t p) {
+        return b_entries(b, a.suffix_col_indices, a.suffix_row_ptr[p],
+                         a.suffix_row_ptr[p + 1]);
+      },
+      [&](index_t p, row_fragment<index_t> &out) {
+        acc.clear();
+        for (offset_t k = a.suffix_row_ptr[p]; k < a.suffix_row_ptr[p + 1];
+             k++)
+          add_b_row(b, a.suffix_col_indices[k], acc);
+        append_sorted(acc, 0, out, with_values);
+      });
+}
+
+/**
+ * @brief Estimated work of a row of C: the entries of B its unique columns
+ * select plus the entries of the products of its patterns.
+ */
+template <typename offset_t, typename index_t>
+int64_t row_cost(const staf_matrix<offset_t, index_t> &a,
+                 const csr_view<offset_t, index_t> &b,
+                 const row_builder<offset_t, index_t> &products,
+                 index_t row) {
+  int64_t cost =
+      b_entries(b, a.col_indices, a.row_ptr[row], a.row_ptr[row + 1]);
+  for (offset_t m = a.row_pattern_ptr[row]; m < a.row_pattern_ptr[row + 1];
+       m++) {
+    index_t p = a.row_pattern_index[m];
+    cost += products.ptr[p + 1] - products.ptr[p];
+  }
+  return cost;
+}
+} // namespace
+
+template <typename offset_t, typename index_t>
+csr_arrays<offset_t, index_t>
+staf_spgemm(const staf_matrix<offset_t, index_t> &a,
+            const csr_view<offset_t, index_t> &b) {
+  const index_t n_parts = omp_get_max_threads();
+  row_builder<offset_t, index_t> products(a.n_patterns, n_parts);
+  row_builder<offset_t, index_t> rows(a.n_rows, n_parts);
+
+#pragma omp parallel
+  {
+    sparse_accumulator<index_t> acc(b.n_cols);
+
+    // Shared part: the B rows of every pattern are merged once.
+    pattern_products(a, b, acc, true, products);
+
+    // Rows: the B rows of the unique columns are merged with the products of
+    // the patterns.
+    rows.run([&](index_t row) { return row_cost(a, b, products, row); },
+             [&](index_t row, row_fragment<index_t> &out) {
+               acc.clear();
+               for (offset_t k = a.row_ptr[row]; k < a.row_ptr[row + 1]; k++)
+                 add_b_row(b, a.col_indices[k], acc);
+               for (offset_t m = a.row_pattern_ptr[row];
+                    m < a.row_pattern_ptr[row + 1]; m++) {
+                 index_t p = a.row_pattern_index[m];
+                 for (offset_t k = products.ptr[p]; k < products.ptr[p + 1];
+                      k++)
+                   acc.add(products.cols[k], products.values[k]);
+               }
+               append_sorted(acc, 0, out, true);
+             });
+  }
+
+  return {std::move(rows.ptr), std::move(rows.cols), std::move(rows.values)};
+}
+
+template <typename offset_t, typename index_t>
+staf_arrays<offset_t, index_t>
+staf_spgemm_structure(const staf_matrix<offset_t, index_t> &a,
+                      const csr_view<offset_t, index_t> &b) {
+  const index_t n_parts = omp_get_max_threads();
+  row_builder<offset_t, index_t> products(a.n_patterns, n_parts);
+  row_builder<offset_t, index_t> rows(a.n_rows, n_parts);
+
+#pragma omp parallel
+  {
+    sparse_accumulator<index_t> acc(b.n_cols);
+    std::vector<index_t> dropped;
+
+    pattern_products(a, b, acc, false, products);
+
+    // A row keeps its patterns while their products are disjoint, everything
+    // else it covers goes into its unique part.
+    rows.run([&](index_t row) { return row_cost(a, b, products, row); },
+             [&](index_t row, row_fragment<index_t> &out) {
+               acc.clear();
+               dropped.clear();
+               for (offset_t m = a.row_pattern_ptr[row];
+                    m < a.row_pattern_ptr[row + 1]; m++) {
+                 index_t p = a.row_pattern_index[m];
+                 offset_t start = products.ptr[p], end = products.ptr[p + 1];
+                 bool disjoint = start < end;
+                 for (offset_t k = start; k < end && disjoint; k++)
+                   disjoint = !acc.contains(products.cols[k]);
+                 if (!disjoint) {
+                   dropped.push_back(p);
+                   continue;
+                 }
+                 for (offset_t k = start; k < end; k++)
+                   acc.add(products.cols[k], 0.0f);
+                 out.patterns.push_back(p);
+               }
+
+               const size_t covered = acc.touched.size();
+               for (offset_t k = a.row_ptr[row]; k < a.row_ptr[row + 1]; k++)
+                 add_b_row(b, a.col_indices[k], acc);
+               for (index_t p : dropped)
+                 for (offset_t k = products.ptr[p]; k < products.ptr[p + 1];
+                      k++)
+                   acc.add(products.cols[k], 0.0f);
+               append_sorted(acc, covered, out, false);
+             });
+  }
+
+  staf_arrays<offset_t, index_t> c;
+  c.n_rows = a.n_rows;
+  c.row_ptr = std::move(rows.ptr);
+  c.col_indices = std::move(rows.cols);
+  c.row_pattern_ptr = std::move(rows.pattern_ptr);
+  c.row_pattern_index = std::move(rows.patterns);
+
+  // Renumber the patterns some row keeps, in their original order.
+  std::vector<offset_t> n_kept(a.n_patterns, 0);
+  for (index_t p : c.row_pattern_index)
+    n_kept[p]++;
+  std::vector<index_t> renumber(a.n_patterns, -1);
+  c.suffix_row_ptr.push_back(0);
+  for (index_t p = 0; p < a.n_patterns; p++) {
+    if (n_kept[p] == 0)
+      continue;
+    renumber[p] = c.suffix_row_ptr.size() - 1;
+    c.suffix_col_indices.insert(c.suffix_col_indices.end(),
+                                products.cols.begin() + products.ptr[p],
+                                products.cols.begin() + products.ptr[p + 1]);
+    c.suffix_row_ptr.push_back(c.suffix_col_indices.size());
+  }
+  for (index_t &p : c.row_pattern_index)
+    p = renumber[p];
+  c.build_map();
+  return c;
+}
+
+template csr_arrays<int32_t, int32_t>
+staf_spgemm(const staf_matrix<int32_t, int32_t> &,
+            const csr_view<int32_t, int32_t> &);
+template csr_arrays<int64_t, int32_t>
+staf_spgemm(const staf_matrix<int64_t, int32_t> &,
+            const csr_view<int64_t, int32_t> &);
+template csr_arrays<int64_t, int64_t>
+staf_spgemm(const staf_matrix<int64_t, int64_t> &,
+            const csr_view<int64_t, int64_t> &);
+template staf_arrays<int32_t, int32_t>
+staf_spgemm_structure(const staf_matrix<int32_t, int32_t> &,
+                      const csr_view<int32_t, int32_t> &);
+template staf_arrays<int64_t, int32_t>
+staf_spgemm_structure(const staf_matrix<int64_t, int32_t> &,
+                      const csr_view<int64_t, int32_t> &);
+template staf_arrays<int64_t, int64_t>
+staf_spgemm_structure(const staf_matrix<int64_t, int64_t> &,
+                      const csr_view<int64_t, int64_t> &);
@@ -0,0 +1,71 @@
+#ifndef STAF_SPGEMM_HPP
+#define STAF_SPGEMM_HPP
+
+#include "staf_spmm.hpp"
+#include <cstdint>
+#include <vector>
+
+/**
+ * @struct csr_view
+ * @brief Non-owning view of a sparse matrix in CSR form.
+ */
+template <typename offset_t, typename index_t> struct csr_view {
+  index_t n_rows;
+  index_t n_cols;
+  const offset_t *row_ptr;    ///< n_rows + 1 entries
+  const index_t *col_indices; ///< Columns of every row
+  const float *values;        ///< Values of every entry, nullptr if all ones
+};
+
+/**
+ * @struct csr_arrays
+ * @brief A sparse matrix in CSR form that owns its arrays. The columns of
+ * every row are sorted.
+ */
+template <typename offset_t, typename index_t> struct csr_arrays {
+  std::vector<offset_t> row_ptr;
+  std::vector<index_t> col_indices;
+  std::vector<float> values;
+};
+
+/**
+ * @brief Multiplies a binary STAF matrix with a sparse matrix, C = A * B.
+ *
+ * The product of every shared pattern with B, the sum of the B rows of its
+ * columns, is computed once. Every row of C then adds the B rows of its
+ * unique columns to the pattern products of its patterns, found through
+ * row_pattern_ptr. Rows are merged in a dense accumulator per thread
+ * (Gustavson's algorithm), and both phases are split into parts of equal
+ * cost, measured in entries of B read.
+ *
+ * @param a The STAF matrix.
+ * @param b The sparse matrix, one row per column of A.
+ * @return C in CSR form. Without values in B, the values of C count the
+ * entries of B summed into them.
+ */
+template <typename offset_t, typename index_t>
+csr_arrays<offset_t, index_t>
+staf_spgemm(const staf_matrix<offset_t, index_t> &a,
+            const csr_view<offset_t, index_t> &b);
+
+/**
+ * @brief Computes the nonzero structure of C = A * B as a binary STAF matrix
+ * that shares the patterns of A.
+ *
+ * Every pattern of A becomes the pattern holding its product with B. A row
+ * of C keeps the patterns of its row in A as long as their products are
+ * disjoint, since staf_spmm adds every pattern in full; the columns of the
+ * other patterns and the products of its unique columns make up its unique
+ * part, without the columns its kept patterns already cover. Patterns no row
+ * keeps are dropped. The values of B are ignored.
+ *
+ * @param a The STAF matrix.
+ * @param b The sparse matrix, one row per column of A.
+ * @return The structure of C in STAF form.
+ */
+template <typename offset_t, typename index_t>
+staf_arrays<offset_t, index_t>
+staf_spgemm_structure(const staf_matrix<offset_t, index_t> &a,
+                      const csr_view<offset_t, index_t> &b);
+
+#endif
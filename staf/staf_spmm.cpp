@@ -0,0 +1,806 @@
+#include "staf_spmm.hpp"
+#include <algorithm>
+#include <cstring>
+#include <immintrin.h>
+#include <omp.h>
+#include <type_traits>
+#include <vector>
+
+namespace {
+// Vector abstraction over the widest instruction set the build targets.
+#if defined(__AVX512F__)
+using vec_t = __m512;
+constexpr int lanes = 16;
+inline vec_t vzero() { return _mm512_setzero_ps(); }
+inline vec_t vload(const float *p) { return _mm512_loadu_ps(p); }
+inline void vstore(float *p, vec_t v) { _mm512_storeu_ps(p, v); }
+inline vec_t vadd(vec_t a, vec_t b) { return _mm512_add_ps(a, b); }
+inline vec_t vmul(vec_t a, vec_t b) { return _mm512_mul_ps(a, b); }
+inline vec_t vset1(float v) { return _mm512_set1_ps(v); }
+#elif defined(__AVX2__)
+using vec_t = __m256;
+constexpr int lanes = 8;
+inline vec_t vzero() { return _mm256_setzero_ps(); }
+inline vec_t vload(const float *p) { return _mm256_loadu_ps(p); }
+inline void vstore(float *p, vec_t v) { _mm256_storeu_ps(p, v); }
+inline vec_t vadd(vec_t a, vec_t b) { return _mm256_add_ps(a, b); }
+inline vec_t vmul(vec_t a, vec_t b) { return _mm256_mul_ps(a, b); }
+inline vec_t vset1(float v) { return _mm256_set1_ps(v); }
+#else
+using vec_t = float;
+constexpr int lanes = 1;
+inline vec_t vzero() { return 0.0f; }
+inline vec_t vload(const float *p) { return *p; }
+inline void vstore(float *p, vec_t v) { *p = v; }
+inline vec_t vadd(vec_t a, vec_t b) { return a + b; }
+inline vec_t vmul(vec_t a, vec_t b) { return a * b; }
+inline vec_t vset1(float v) { return v; }
+#endif
+
+// Widest column tile whose accumulators stay in registers, leaving the other
+// half of the register file for the loaded rows.
+constexpr int max_tile = 8 * lanes;
+
+/*------------------------Scalar conversions---------------------------*/
+inline float bits_to_float(uint32_t bits) {
+  float f;
+  std::memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+inline uint32_t float_to_bits(float f) {
+  uint32_t bits;
+  std::memcpy(&bits, &f, sizeof(bits));
+  return bits;
+}
+
+inline float bf16_to_float(uint16_t h) {
+  return bits_to_float(static_cast<uint32_t>(h) << 16);
+}
+
+inline uint16_t float_to_bf16(float f) {
+  uint32_t bits = float_to_bits(f);
+  // Rounding would carry a payload in the low half into the exponent.
+  if ((bits & 0x7FFFFFFF) > 0x7F800000) // nan, quieted
+    return static_cast<uint16_t>((bits >> 16) | 0x0040);
+  bits += 0x7FFF + ((bits >> 16) & 1); // round to nearest even
+  return static_cast<uint16_t>(bits >> 16);
+}
+
+inline float half_to_float(uint16_t h) {
+#if defined(__F16C__)
+  return _cvtsh_ss(h);
+#else
+  uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+  uint32_t exp = (h >> 10) & 0x1F;
+  uint32_t mant = h & 0x3FF;
+  if (exp == 0x1F)
+    return bits_to_float(sign | 0x7F800000 | (mant << 13));
+  if (exp == 0) {
+    // subnormal or zero: mant * 2^-24
+    float f = static_cast<float>(mant) * (1.0f / 16777216.0f);
+    return sign ? -f : f;
+  }
+  return bits_to_float(sign | ((exp + 112) << 23) | (mant << 13));
+#endif
+}
+
+inline uint16_t float_to_half(float f) {
+#if defined(__F16C__)
+  return _cvtss_sh(f, _MM_FROUND_TO_NEAREST_INT);
+#else
+  uint32_t bits = float_to_bits(f);
+  uint16_t sign = (bits >> 16) & 0x8000;
+  uint32_t abs = bits & 0x7FFFFFFF;
+  if (abs > 0x7F800000) // nan, quieted with its payload kept
+    return sign | 0x7E00 | ((abs >> 13) & 0x3FF);
+  if (abs == 0x7F800000)
+    return sign | 0x7C00;
+  if (abs >= 0x477FF000) // rounds to a value beyond the half range
+    return sign | 0x7C00;
+  if (abs < 0x38800000) { // subnormal half or zero
+    float scaled = bits_to_float(abs) * 16777216.0f;
+    return sign | static_cast<uint16_t>(__builtin_lrintf(scaled));
+  }
+  uint32_t rounded = abs + 0xFFF + ((abs >> 13) & 1);
+  return sign | static_cast<uint16_t>((rounded - 0x38000000) >> 13);
+#endif
+}
+
+/*------------------------Element types--------------------------------*/
+// Every element type reads lanes values into an fp32 vector and writes an
+// fp32 vector back in its own precision.
+
+struct f32_t {
+  using storage = float;
+  static float to_float(storage v) { return v; }
+  static storage from_float(float v) { return v; }
+  static vec_t load(const storage *p) { return vload(p); }
+  static void store(storage *p, vec_t v) { vstore(p, v); }
+};
+
+struct f16_t {
+  using storage = uint16_t;
+  static float to_float(storage v) { return half_to_float(v); }
+  static storage from_float(float v) { return float_to_half(v); }
+#if defined(__AVX512F__)
+  static vec_t load(const storage *p) {
+    return _mm512_cvtph_ps(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p)));
+  }
+  static void store(storage *p, vec_t v) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(p),
+                        _mm512_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+  }
+#elif defined(__AVX2__) && defined(__F16C__)
+  static vec_t load(const storage *p) {
+    return _mm256_cvtph_ps(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(p)));
+  }
+  static void store(storage *p, vec_t v) {
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(p),
+                     _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+  }
+#else
+  static vec_t load(const storage *p) {
+    float buf[lanes];
+    for (int i = 0; i < lanes; i++)
+      buf[i] = half_to_float(p[i]);
+    return vload(buf);
+  }
+  static void store(storage *p, vec_t v) {
+    float buf[lanes];
+    vstore(buf, v);
+    for (int i = 0; i < lanes; i++)
+      p[i] = float_to_half(buf[i]);
+  }
+#endif
+};
+
+struct bf16_t {
+  using storage = uint16_t;
+  static float to_float(storage v) { return bf16_to_float(v); }
+  static storage from_float(float v) { return float_to_bf16(v); }
+#if defined(__AVX512F__)
+  static vec_t load(const storage *p) {
+    __m512i wide = _mm512_cvtepu16_epi32(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p)));
+    return _mm512_castsi512_ps(_mm512_slli_epi32(wide, 16));
+  }
+  static void store(storage *p, vec_t v) {
+    __m512i bits = _mm512_castps_si512(v);
+    __m512i high = _mm512_srli_epi32(bits, 16);
+    __m512i odd = _mm512_and_si512(high, _mm512_set1_epi32(1));
+    bits = _mm512_add_epi32(
+        bits, _mm512_add_epi32(odd, _mm512_set1_epi32(0x7FFF)));
+    // nans are quieted instead of rounded, as in float_to_bf16
+    __mmask16 nan = _mm512_cmp_ps_mask(v, v, _CMP_UNORD_Q);
+    bits = _mm512_mask_blend_epi32(
+        nan, _mm512_srli_epi32(bits, 16),
+        _mm512_or_si512(high, _mm512_set1_epi32(0x0040)));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(p),
+                        _mm512_cvtepi32_epi16(bits));
+  }
+#elif defined(__AVX2__)
+  static vec_t load(const storage *p) {
+    __m256i wide = _mm256_cvtepu16_epi32(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(p)));
+    return _mm256_castsi256_ps(_mm256_slli_epi32(wide, 16));
+  }
+  static void store(storage *p, vec_t v) {
+    __m256i bits = _mm256_castps_si256(v);
+    __m256i high = _mm256_srli_epi32(bits, 16);
+    __m256i odd = _mm256_and_si256(high, _mm256_set1_epi32(1));
+    bits = _mm256_add_epi32(
+        bits, _mm256_add_epi32(odd, _mm256_set1_epi32(0x7FFF)));
+    // nans are quieted instead of rounded, as in float_to_bf16
+    __m256i nan = _mm256_castps_si256(_mm256_cmp_ps(v, v, _CMP_UNORD_Q));
+    bits = _mm256_blendv_epi8(_mm256_srli_epi32(bits, 16),
+                              _mm256_or_si256(high, _mm256_set1_epi32(0x0040)),
+                              nan);
+    // pack the 8 halves of both 128 bit lanes next to each other
+    __m256i packed = _mm256_permute4x64_epi64(
+        _mm256_packus_epi32(bits, bits), 0b00001000);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(p),
+                     _mm256_castsi256_si128(packed));
+  }
+#else
+  static vec_t load(const storage *p) { return bf16_to_float(*p); }
+  static void store(storage *p, vec_t v) { *p = float_to_bf16(v); }
+#endif
+};
+
+/**
+ * @brief Sums the rows of X selected by cols over a tile of tile columns and
+ * stores the result to out. The accumulators are fully unrolled so they live
+ * in registers for the whole pass over cols.
+ */
+template <typename in_t, int tile, typename index_t>
+inline void gather_tile(const typename in_t::storage *x, int64_t ldx,
+                        const index_t *cols, size_t n, float *out) {
+  constexpr int nr_vecs = tile / lanes;
+  vec_t acc[nr_vecs];
+#pragma GCC unroll 16
+  for (int v = 0; v < nr_vecs; v++)
+    acc[v] = vzero();
+
+  for (size_t k = 0; k < n; k++) {
+    const typename in_t::storage *row = x + static_cast<int64_t>(cols[k]) * ldx;
+#pragma GCC unroll 16
+    for (int v = 0; v < nr_vecs; v++)
+      acc[v] = vadd(acc[v], in_t::load(row + v * lanes));
+  }
+
+#pragma GCC unroll 16
+  for (int v = 0; v < nr_vecs; v++)
+    vstore(out + v * lanes, acc[v]);
+}
+
+/**
+ * @brief Row gather for a feature width known at compile time.
+ */
+template <int width> struct fixed_width {
+  static constexpr int tile = std::min(width, max_tile);
+  static_assert(width % tile == 0 && tile % lanes == 0,
+                "width must be a multiple of the tile size");
+
+  int64_t get() const { return width; }
+
+  template <typename in_t, typename index_t>
+  void gather(const typename in_t::storage *x, const index_t *cols, size_t n,
+              float *out) const {
+    for (int t = 0; t < width; t += tile)
+      gather_tile<in_t, tile>(x + t, width, cols, n, out + t);
+  }
+};
+
+/**
+ * @brief Row gather for any feature width: register tiles first, then single
+ * vectors, then a scalar tail.
+ */
+struct runtime_width {
+  int64_t width;
+
+  int64_t get() const { return width; }
+
+  template <typename in_t, typename index_t>
+  void gather(const typename in_t::storage *x, const index_t *cols, size_t n,
+              float *out) const {
+    int64_t t = 0;
+    for (; t + max_tile <= width; t += max_tile)
+      gather_tile<in_t, max_tile>(x + t, width, cols, n, out + t);
+    for (; t + lanes <= width; t += lanes)
+      gather_tile<in_t, lanes>(x + t, width, cols, n, out + t);
+    for (; t < width; t++) {
+      float sum = 0.0f;
+      for (size_t k = 0; k < n; k++)
+        sum += in_t::to_float(x[static_cast<int64_t>(cols[k]) * width + t]);
+      out[t] = sum;
+    }
+  }
+};
+
+/**
+ * @brief Converts an fp32 row to the output precision.
+ */
+template <typename out_t>
+void store_row(const float *src, typename out_t::storage *dst, int64_t width) {
+  const int64_t body = width - width % lanes;
+  for (int64_t t = 0; t < body; t += lanes)
+    out_t::store(dst + t, vload(src + t));
+  for (int64_t t = body; t < width; t++)
+    dst[t] = out_t::from_float(src[t]);
+}
+
+/**
+ * @brief Adds an fp32 row to another, dst += src.
+ */
+inline void add_row(float *dst, const float *src, int64_t width) {
+  const int64_t body = width - width % lanes;
+  for (int64_t t = 0; t < body; t += lanes)
+    vstore(dst + t, vadd(vload(dst + t), vload(src + t)));
+  for (int64_t t = body; t < width; t++)
+    dst[t] += src[t];
+}
+
+/**
+ * @brief Index source reading the uncompressed index arrays in place.
+ */
+template <typename offset_t, typename index_t> struct plain_indices {
+  const staf_matrix<offset_t, index_t> &a;
+
+  const index_t *cols(index_t, offset_t start, size_t,
+                      std::vector<index_t> &) const {
+    return a.col_indices + start;
+  }
+  const index_t *suffix_cols(index_t, offset_t start, size_t,
+                             std::vector<index_t> &) const {
+    return a.suffix_col_indices + start;
+  }
+  const index_t *row_patterns(index_t, offset_t start, size_t,
+                              std::vector<index_t> &) const {
+    return a.row_pattern_index + start;
+  }
+};
+
+/**
+ * @brief Index source decoding packed segments into a per-thread scratch
+ * buffer right before they are used.
+ */
+template <typename offset_t, typename index_t> struct decoded_indices {
+  const staf_packed_indices<offset_t, index_t> &packed;
+
+  static const index_t *decode(const packed_view<offset_t, index_t> &v,
+                               index_t seg, size_t n,
+                               std::vector<index_t> &scratch) {
+    if (scratch.size() < n)
+      scratch.resize(n);
+    decode_segment(v, seg, n, scratch.data());
+    return scratch.data();
+  }
+
+  const index_t *cols(index_t row, offset_t, size_t n,
+                      std::vector<index_t> &scratch) const {
+    return decode(packed.col_indices, row, n, scratch);
+  }
+  const index_t *suffix_cols(index_t p, offset_t, size_t n,
+                             std::vector<index_t> &scratch) const {
+    return decode(packed.suffix_col_indices, p, n, scratch);
+  }
+  const index_t *row_patterns(index_t row, offset_t, size_t n,
+                              std::vector<index_t> &scratch) const {
+    return decode(packed.row_pattern_index, row, n, scratch);
+  }
+};
+
+/**
+ * @brief Scales an fp32 row and mixes in a row of the teleport matrix,
+ * dst = scale * dst + alpha * src.
+ */
+template <typename tp_t>
+void mix_row(float *dst, float scale, const typename tp_t::storage *src,
+             float alpha, int64_t width) {
+  const int64_t body = width - width % lanes;
+  const vec_t vscale = vset1(scale);
+  if (alpha == 0.0f) {
+    for (int64_t t = 0; t < body; t += lanes)
+      vstore(dst + t, vmul(vload(dst + t), vscale));
+    for (int64_t t = body; t < width; t++)
+      dst[t] *= scale;
+    return;
+  }
+
+  const vec_t valpha = vset1(alpha);
+  for (int64_t t = 0; t < body; t += lanes)
+    vstore(dst + t, vadd(vmul(vload(dst + t), vscale),
+                         vmul(tp_t::load(src + t), valpha)));
+  for (int64_t t = body; t < width; t++)
+    dst[t] = scale * dst[t] + alpha * tp_t::to_float(src[t]);
+}
+
+/**
+ * @brief Parameters of a propagation, H_{t+1} = (1 - alpha) * diag(row_scale)
+ * * A * H_t + alpha * X. A plain multiplication is one hop without mixing.
+ */
+struct propagation {
+  int n_hops = 1;
+  float alpha = 0.0f;
+  const float *row_scale = nullptr;
+
+  bool mixing() const { return alpha != 0.0f || row_scale; }
+};
+
+/**
+ * @brief Per-thread buffers of the SpMM passes.
+ */
+template <typename index_t> struct spmm_workspace {
+  std::vector<index_t> scratch;
+  std::vector<float> acc;
+};
+
+/**
+ * @brief One SpMM pass y = A * x, mixed with the teleport matrix x0. Must be
+ * called by every thread of the team; the two worksharing loops end in
+ * barriers, so consecutive passes may read each other's output.
+ */
+template <typename in_t, typename out_t, typename tp_t, typename width_policy,
+          typename offset_t, typename index_t, typename source_t>
+void spmm_pass(const staf_matrix<offset_t, index_t> &a, const source_t &source,
+               const staf_schedule<offset_t, index_t> &s,
+               const typename in_t::storage *x, typename out_t::storage *y,
+               const typename tp_t::storage *x0, const propagation &prop,
+               float *partials, spmm_workspace<index_t> &ws,
+               const width_policy &policy) {
+  const int64_t width = policy.get();
+
+  // Shared part: every pattern is accumulated once.
+#pragma omp for schedule(static, 1)
+  for (index_t k = 0; k < s.n_parts; k++) {
+    for (index_t p = s.pattern_bounds[k]; p < s.pattern_bounds[k + 1]; p++) {
+      offset_t start = a.suffix_row_ptr[p];
+      size_t n = a.suffix_row_ptr[p + 1] - start;
+      policy.template gather<in_t>(
+          x, source.suffix_cols(p, start, n, ws.scratch), n,
+          partials + p * width);
+    }
+  }
+
+  // Rows: every row is owned by one part and pulls the results of its
+  // patterns, fp32 rows are accumulated in place.
+#pragma omp for schedule(static, 1)
+  for (index_t k = 0; k < s.n_parts; k++) {
+    for (index_t row = s.row_bounds[k]; row < s.row_bounds[k + 1]; row++) {
+      float *out = ws.acc.data();
+      if constexpr (std::is_same_v<out_t, f32_t>)
+        out = y + row * width;
+
+      offset_t start = a.row_ptr[row];
+      size_t n = a.row_ptr[row + 1] - start;
+      policy.template gather<in_t>(x, source.cols(row, start, n, ws.scratch),
+                                   n, out);
+
+      start = a.row_pattern_ptr[row];
+      n = a.row_pattern_ptr[row + 1] - start;
+      const index_t *patterns =
+          source.row_patterns(row, start, n, ws.scratch);
+      for (size_t m = 0; m < n; m++)
+        add_row(out, partials + patterns[m] * width, width);
+
+      if (prop.mixing()) {
+        float scale = 1.0f - prop.alpha;
+        if (prop.row_scale)
+          scale *= prop.row_scale[row];
+        mix_row<tp_t>(out, scale, x0 + row * width, prop.alpha, width);
+      }
+
+      if constexpr (!std::is_same_v<out_t, f32_t>)
+        store_row<out_t>(out, y + row * width, width);
+    }
+  }
+}
+
+/**
+ * @brief Runs all hops of a propagation in one thread team. Hops between
+ * the first and the last alternate between two fp32 buffers, the first of
+ * which is Y itself when Y is fp32. The pattern buffer is reused by every
+ * hop.
+ */
+template <typename width_policy, typename in_t, typename out_t,
+          typename offset_t, typename index_t, typename source_t>
+void spmm(const staf_matrix<offset_t, index_t> &a, const source_t &source,
+          const staf_schedule<offset_t, index_t> &s,
+          const typename in_t::storage *x, typename out_t::storage *y,
+          const propagation &prop, const width_policy &policy) {
+  const int64_t width = policy.get();
+  const int n_hops = prop.n_hops;
+  std::vector<float> partials(static_cast<size_t>(a.n_patterns) * width);
+
+  // Hop t writes hops[(n_hops - 1 - t) % 2] and reads what hop t - 1 wrote,
+  // the last hop writes y. hops[1] is needed from two hops on, hops[0] from
+  // three.
+  std::vector<float> buffers[2];
+  float *hops[2] = {nullptr, nullptr};
+  for (int i = 0; i < 2; i++) {
+    if (n_hops < 3 - i)
+      continue;
+    if constexpr (std::is_same_v<out_t, f32_t>) {
+      if (i == 0) {
+        hops[i] = y;
+        continue;
+      }
+    }
+    buffers[i].resize(static_cast<size_t>(a.n_rows) * width);
+    hops[i] = buffers[i].data();
+  }
+
+#pragma omp parallel
+  {
+    spmm_workspace<index_t> ws;
+    ws.acc.resize(width);
+
+    for (int t = 0; t < n_hops; t++) {
+      float *dst = t + 1 < n_hops ? hops[(n_hops - 1 - t) % 2] : nullptr;
+      const float *src = t > 0 ? hops[(n_hops - t) % 2] : nullptr;
+      if (t == 0 && dst)
+        spmm_pass<in_t, f32_t, in_t>(a, source, s, x, dst, x, prop,
+                                     partials.data(), ws, policy);
+      else if (t == 0)
+        spmm_pass<in_t, out_t, in_t>(a, source, s, x, y, x, prop,
+                                     partials.data(), ws, policy);
+      else if (dst)
+        spmm_pass<f32_t, f32_t, in_t>(a, source, s, src, dst, x, prop,
+                                      partials.data(), ws, policy);
+      else
+        spmm_pass<f32_t, out_t, in_t>(a, source, s, src, y, x, prop,
+                                      partials.data(), ws, policy);
+    }
+  }
+}
+
+template <typename in_t, typename out_t, typename offset_t, typename index_t,
+          typename source_t>
+void dispatch_width(const staf_matrix<offset_t, index_t> &a,
+                    const source_t &source,
+                    const staf_schedule<offset_t, index_t> &s,
+                    const typename in_t::storage *x,
+                    typename out_t::storage *y, int64_t width,
+                    const propagation &prop) {
+  switch (width) {
+  case 16:
+    spmm<fixed_width<16>, in_t, out_t>(a, source, s, x, y, prop, {});
+    break;
+  case 32:
+    spmm<fixed_width<32>, in_t, out_t>(a, source, s, x, y, prop, {});
+    break;
+  case 64:
+    spmm<fixed_width<64>, in_t, out_t>(a, source, s, x, y, prop, {});
+    break;
+  case 128:
+    spmm<fixed_width<128>, in_t, out_t>(a, source, s, x, y, prop, {});
+    break;
+  case 256:
+    spmm<fixed_width<256>, in_t, out_t>(a, source, s, x, y, prop, {});
+    break;
+  default:
+    spmm<runtime_width, in_t, out_t>(a, source, s, x, y, prop, {width});
+    break;
+  }
+}
+
+template <typename in_t, typename offset_t, typename index_t,
+          typename source_t>
+void dispatch_output(const staf_matrix<offset_t, index_t> &a,
+                     const source_t &source,
+                     const staf_schedule<offset_t, index_t> &s,
+                     const typename in_t::storage *x, void *y,
+                     staf_dtype y_dtype, int64_t width,
+                     const propagation &prop) {
+  switch (y_dtype) {
+  case staf_dtype::float32:
+    dispatch_width<in_t, f32_t>(a, source, s, x, static_cast<float *>(y),
+                                width, prop);
+    break;
+  case staf_dtype::float16:
+    dispatch_width<in_t, f16_t>(a, source, s, x, static_cast<uint16_t *>(y),
+                                width, prop);
+    break;
+  case staf_dtype::bfloat16:
+    dispatch_width<in_t, bf16_t>(a, source, s, x, static_cast<uint16_t *>(y),
+                                 width, prop);
+    break;
+  }
+}
+
+template <typename offset_t, typename index_t, typename source_t>
+void dispatch_input(const staf_matrix<offset_t, index_t> &a,
+                    const source_t &source,
+                    const staf_schedule<offset_t, index_t> &s, const void *x,
+                    staf_dtype x_dtype, void *y, staf_dtype y_dtype,
+                    int64_t width, const propagation &prop) {
+  switch (x_dtype) {
+  case staf_dtype::float32:
+    dispatch_output<f32_t>(a, source, s, static_cast<const float *>(x), y,
+                           y_dtype, width, prop);
+    break;
+  case staf_dtype::float16:
+    dispatch_output<f16_t>(a, source, s, static_cast<const uint16_t *>(x), y,
+                           y_dtype, width, prop);
+    break;
+  case staf_dtype::bfloat16:
+    dispatch_output<bf16_t>(a, source, s, static_cast<const uint16_t *>(x), y,
+                            y_dtype, width, prop);
+    break;
+  }
+}
+
+/**
+ * @brief Splits n items into n_parts consecutive ranges of equal cost, where
+ * cost(i) is the nondecreasing cost of the items before item i.
+ */
+template <typename index_t, typename cost_t>
+void split_merge_path(index_t n, const cost_t &cost, index_t n_parts,
+                      index_t *bounds) {
+  const int64_t total = cost(n);
+  index_t i = 0;
+  for (index_t k = 0; k <= n_parts; k++) {
+    const int64_t target = total * k / n_parts;
+    while (i < n && cost(i) < target)
+      i++;
+    bounds[k] = i;
+  }
+}
+
+/**
+ * @brief Schedule with one part per thread, owned by the caller of a single
+ * multiplication that was not given a precomputed one.
+ */
+template <typename offset_t, typename index_t> struct owned_schedule {
+  std::vector<index_t> row_bounds, pattern_bounds;
+  staf_schedule<offset_t, index_t> view;
+
+  owned_schedule(const staf_matrix<offset_t, index_t> &a,
+                 const staf_schedule<offset_t, index_t> *given) {
+    if (given) {
+      view = *given;
+      return;
+    }
+    index_t n_parts = omp_get_max_threads();
+    row_bounds.resize(n_parts + 1);
+    pattern_bounds.resize(n_parts + 1);
+    staf_make_schedule(a, n_parts, row_bounds.data(), pattern_bounds.data());
+    view = {n_parts, row_bounds.data(), pattern_bounds.data()};
+  }
+};
+} // namespace
+
+template <typename offset_t, typename index_t>
+staf_matrix<offset_t, index_t> staf_arrays<offset_t, index_t>::view() const {
+  return {n_rows,
+          row_ptr.data(),
+          col_indices.data(),
+          static_cast<index_t>(suffix_row_ptr.size() - 1),
+          suffix_row_ptr.data(),
+          suffix_col_indices.data(),
+          map_suffix_ptr.data(),
+          map_row_index.data(),
+          row_pattern_ptr.data(),
+          row_pattern_index.data()};
+}
+
+template <typename offset_t, typename index_t>
+void staf_arrays<offset_t, index_t>::build_map() {
+  const index_t n_patterns = suffix_row_ptr.size() - 1;
+  map_suffix_ptr.assign(n_patterns + 1, 0);
+  for (index_t p : row_pattern_index)
+    map_suffix_ptr[p + 1]++;
+  for (index_t p = 0; p < n_patterns; p++)
+    map_suffix_ptr[p + 1] += map_suffix_ptr[p];
+
+  map_row_index.resize(map_suffix_ptr[n_patterns]);
+  std::vector<offset_t> next(map_suffix_ptr.begin(), map_suffix_ptr.end() - 1);
+  for (index_t row = 0; row < n_rows; row++) {
+    for (offset_t m = row_pattern_ptr[row]; m < row_pattern_ptr[row + 1]; m++)
+      map_row_index[next[row_pattern_index[m]]++] = row;
+  }
+}
+
+template <typename offset_t, typename index_t>
+void staf_make_schedule(const staf_matrix<offset_t, index_t> &a,
+                        index_t n_parts, index_t *row_bounds,
+                        index_t *pattern_bounds) {
+  // Patterns: the cost of the patterns before p is p + suffix_row_ptr[p].
+  split_merge_path(
+      a.n_patterns,
+      [&](index_t p) { return p + static_cast<int64_t>(a.suffix_row_ptr[p]); },
+      n_parts, pattern_bounds);
+
+  // Rows: each row also pays for the pattern results it adds.
+  split_merge_path(
+      a.n_rows,
+      [&](index_t row) {
+        return row + static_cast<int64_t>(a.row_ptr[row]) +
+               a.row_pattern_ptr[row];
+      },
+      n_parts, row_bounds);
+}
+
+template <typename offset_t, typename index_t>
+void staf_spmm(const staf_matrix<offset_t, index_t> &a, const void *x,
+               staf_dtype x_dtype, void *y, staf_dtype y_dtype, int64_t width,
+               const staf_schedule<offset_t, index_t> *schedule) {
+  owned_schedule<offset_t, index_t> s(a, schedule);
+  dispatch_input(a, plain_indices<offset_t, index_t>{a}, s.view, x, x_dtype,
+                 y, y_dtype, width, propagation{});
+}
+
+template <typename offset_t, typename index_t>
+void staf_spmm(const staf_matrix<offset_t, index_t> &a, const float *x,
+               float *y, int64_t width,
+               const staf_schedule<offset_t, index_t> *schedule) {
+  owned_schedule<offset_t, index_t> s(a, schedule);
+  dispatch_width<f32_t, f32_t>(a, plain_indices<offset_t, index_t>{a}, s.view,
+                               x, y, width, propagation{});
+}
+
+template <typename offset_t, typename index_t>
+void staf_spmm(const staf_matrix<offset_t, index_t> &a,
+               const staf_packed_indices<offset_t, index_t> &packed,
+               const void *x, staf_dtype x_dtype, void *y, staf_dtype y_dtype,
+               int64_t width,
+               const staf_schedule<offset_t, index_t> *schedule) {
+  owned_schedule<offset_t, index_t> s(a, schedule);
+  dispatch_input(a, decoded_indices<offset_t, index_t>{packed}, s.view, x,
+                 x_dtype, y, y_dtype, width, propagation{});
+}
+
+template <typename offset_t, typename index_t>
+void staf_propagate(const staf_matrix<offset_t, index_t> &a, const void *x,
+                    staf_dtype x_dtype, void *y, staf_dtype y_dtype,
+                    int64_t width, int n_hops, float alpha,
+                    const float *row_scale,
+                    const staf_schedule<offset_t, index_t> *schedule) {
+  owned_schedule<offset_t, index_t> s(a, schedule);
+  dispatch_input(a, plain_indices<offset_t, index_t>{a}, s.view, x, x_dtype,
+                 y, y_dtype, width, propagation{n_hops, alpha, row_scale});
+}
+
+template <typename offset_t, typename index_t>
+void staf_propagate(const staf_matrix<offset_t, index_t> &a,
+                    const staf_packed_indices<offset_t, index_t> &packed,
+                    const void *x, staf_dtype x_dtype, void *y,
+                    staf_dtype y_dtype, int64_t width, int n_hops, float alpha,
+                    const float *row_scale,
+                    const staf_schedule<offset_t, index_t> *schedule) {
+  owned_schedule<offset_t, index_t> s(a, schedule);
+  dispatch_input(a, decoded_indices<offset_t, index_t>{packed}, s.view, x,
+                 x_dtype, y, y_dtype, width,
+                 propagation{n_hops, alpha, row_scale});
+}
+
+template struct staf_arrays<int32_t, int32_t>;
+template struct staf_arrays<int64_t, int32_t>;
+template struct staf_arrays<int64_t, int64_t>;
+
+template void staf_spmm(const staf_matrix<int32_t, int32_t> &, const void *,
+                        staf_dtype, void *, staf_dtype, int64_t,
+                        const staf_schedule<int32_t, int32_t> *);
+template void staf_spmm(const staf_matrix<int64_t, int32_t> &, const void *,
+                        staf_dtype, void *, staf_dtype, int64_t,
+                        const staf_schedule<int64_t, int32_t> *);
+template void staf_spmm(const staf_matrix<int64_t, int64_t> &, const void *,
+                        staf_dtype, void *, staf_dtype, int64_t,
+                        const staf_schedule<int64_t, int64_t> *);
+template void staf_spmm(const staf_matrix<int32_t, int32_t> &, const float *,
+                        float *, int64_t,
+                        const staf_schedule<int32_t, int32_t> *);
+template void staf_spmm(const staf_matrix<int64_t, int32_t> &, const float *,
+                        float *, int64_t,
+                        const staf_schedule<int64_t, int32_t> *);
+template void staf_spmm(const staf_matrix<int64_t, int64_t> &, const float *,
+                        float *, int64_t,
+                        const staf_schedule<int64_t, int64_t> *);
+template void staf_spmm(const staf_matrix<int32_t, int32_t> &,
+                        const staf_packed_indices<int32_t, int32_t> &,
+                        const void *, staf_dtype, void *, staf_dtype, int64_t,
+                        const staf_schedule<int32_t, int32_t> *);
+template void staf_spmm(const staf_matrix<int64_t, int32_t> &,
+                        const staf_packed_indices<int64_t, int32_t> &,
+                        const void *, staf_dtype, void *, staf_dtype, int64_t,
+                        const staf_schedule<int64_t, int32_t> *);
+template void staf_spmm(const staf_matrix<int64_t, int64_t> &,
+                        const staf_packed_indices<int64_t, int64_t> &,
+                        const void *, staf_dtype, void *, staf_dtype, int64_t,
+                        const staf_schedule<int64_t, int64_t> *);
+template void staf_propagate(const staf_matrix<int32_t, int32_t> &,
+                             const void *, staf_dtype, void *, staf_dtype,
+                             int64_t, int, float, const float *,
+                             const staf_schedule<int32_t, int32_t> *);
+template void staf_propagate(const staf_matrix<int64_t, int32_t> &,
+                             const void *, staf_dtype, void *, staf_dtype,
+                             int64_t, int, float, const float *,
+                             const staf_schedule<int64_t, int32_t> *);
+template void staf_propagate(const staf_matrix<int64_t, int64_t> &,
+                             const void *, staf_dtype, void *, staf_dtype,
+                             int64_t, int, float, const float *,
+                             const staf_schedule<int64_t, int64_t> *);
+template void staf_propagate(const staf_matrix<int32_t, int32_t> &,
+                             const staf_packed_indices<int32_t, int32_t> &,
+                             const void *, staf_dtype, void *, staf_dtype,
+                             int64_t, int, float, const float *,
+                             const staf_schedule<int32_t, int32_t> *);
+template void staf_propagate(const staf_matrix<int64_t, int32_t> &,
+                             const staf_packed_indices<int64_t, int32_t> &,
+                             const void *, staf_dtype, void *, staf_dtype,
+                             int64_t, int, float, const float *,
+                             const staf_schedule<int64_t, int32_t> *);
+template void staf_propagate(const staf_matrix<int64_t, int64_t> &,
+                             const staf_packed_indices<int64_t, int64_t> &,
+                             const void *, staf_dtype, void *, staf_dtype,
+                             int64_t, int, float, const float *,
+                             const staf_schedule<int64_t, int64_t> *);
+template void staf_make_schedule(const staf_matrix<int32_t, int32_t> &,
+                                 int32_t, int32_t *, int32_t *);
+template void staf_make_schedule(const staf_matrix<int64_t, int32_t> &,
+                                 int32_t, int32_t *, int32_t *);
+template void staf_make_schedule(const staf_matrix<int64_t, int64_t> &,
+                                 int64_t, int64_t *, int64_t *);
@@ -0,0 +1,213 @@
+#ifndef STAF_SPMM_HPP
+#define STAF_SPMM_HPP
+
+#include "packed_indices.hpp"
+#include <cstdint>
+#include <vector>
+
+/**
+ * @struct staf_matrix
+ * @brief Non-owning view of the arrays of a STAF matrix as produced by
+ * binary_csr: the unique part in CSR form, the shared patterns, the map
+ * from every pattern to the rows that contain it and its inverse.
+ *
+ * @tparam offset_t Integer type of the pointer arrays.
+ * @tparam index_t Integer type of the row and column indices.
+ */
+template <typename offset_t, typename index_t> struct staf_matrix {
+  index_t n_rows;
+  const offset_t *row_ptr;     ///< Unique part, n_rows + 1 entries
+  const index_t *col_indices;  ///< Columns of the unique part
+  index_t n_patterns;          ///< Number of shared patterns
+  const offset_t *suffix_row_ptr;    ///< Pattern pointers, n_patterns + 1
+  const index_t *suffix_col_indices; ///< Columns of the shared patterns
+  const offset_t *map_suffix_ptr;   ///< Map offsets, n_patterns + 1
+  const index_t *map_row_index;     ///< Rows of every pattern
+  const offset_t *row_pattern_ptr;  ///< Inverse map offsets, n_rows + 1
+  const index_t *row_pattern_index; ///< Patterns of every row
+};
+
+/**
+ * @struct staf_arrays
+ * @brief A binary STAF matrix that owns its arrays, laid out as the
+ * staf_matrix view expects.
+ */
+template <typename offset_t, typename index_t> struct staf_arrays {
+  index_t n_rows = 0;
+  std::vector<offset_t> row_ptr;
+  std::vector<index_t> col_indices;
+  std::vector<offset_t> suffix_row_ptr;
+  std::vector<index_t> suffix_col_indices;
+  std::vector<offset_t> map_suffix_ptr;
+  std::vector<index_t> map_row_index;
+  std::vector<offset_t> row_pattern_ptr;
+  std::vector<index_t> row_pattern_index;
+
+  /**
+   * @brief Returns a view of the arrays for staf_spmm and staf_spgemm.
+   */
+  staf_matrix<offset_t, index_t> view() const;
+
+  /**
+   * @brief Fills map_suffix_ptr and map_row_index as the inverse of the row
+   * patterns, with the rows of every pattern in ascending order.
+   */
+  void build_map();
+};
+
+/**
+ * @struct staf_packed_indices
+ * @brief Packed encodings of the index arrays of a STAF matrix read by
+ * staf_spmm. The segments are the patterns for suffix_col_indices and the rows
+ * for the other two.
+ */
+template <typename offset_t, typename index_t> struct staf_packed_indices {
+  packed_view<offset_t, index_t> col_indices;
+  packed_view<offset_t, index_t> suffix_col_indices;
+  packed_view<offset_t, index_t> row_pattern_index;
+};
+
+/**
+ * @struct staf_schedule
+ * @brief Non-owning view of a partition of the SpMM work into n_parts parts of
+ * equal cost, as computed by staf_make_schedule. Part k accumulates the
+ * patterns [pattern_bounds[k], pattern_bounds[k + 1]) and then computes the
+ * rows [row_bounds[k], row_bounds[k + 1]).
+ */
+template <typename offset_t, typename index_t> struct staf_schedule {
+  index_t n_parts;
+  const index_t *row_bounds;     ///< n_parts + 1 row boundaries
+  const index_t *pattern_bounds; ///< n_parts + 1 pattern boundaries
+};
+
+/**
+ * @brief Partitions the work of staf_spmm on a into parts of equal cost.
+ *
+ * Both phases are split along a merge path: the patterns over their count
+ * plus their columns, the rows over their count plus their unique columns
+ * plus the patterns they gather. The schedule only depends on the matrix and
+ * can be reused for every multiplication.
+ *
+ * @param a The STAF matrix.
+ * @param n_parts Number of parts, usually the number of threads.
+ * @param row_bounds Output, n_parts + 1 entries.
+ * @param pattern_bounds Output, n_parts + 1 entries.
+ */
+template <typename offset_t, typename index_t>
+void staf_make_schedule(const staf_matrix<offset_t, index_t> &a,
+                        index_t n_parts, index_t *row_bounds,
+                        index_t *pattern_bounds);
+
+/**
+ * @brief Multiplies a binary STAF matrix with a dense row-major matrix,
+ * Y = A * X.
+ *
+ * The columns of every shared pattern are accumulated once into a buffer of
+ * n_patterns rows. Every output row is then computed by a single thread from
+ * its unique columns and the buffered results of its patterns, found through
+ * row_pattern_ptr, so no two threads write the same row and no atomics are
+ * needed. Feature widths of 16, 32, 64, 128 and 256 use kernels specialized
+ * at compile time whose accumulators stay in vector registers, all other
+ * widths use a generic kernel.
+ *
+ * @param a The STAF matrix.
+ * @param x Dense input matrix, one row per column of A.
+ * @param y Dense output matrix, one row per row of A. Overwritten.
+ * @param width Number of columns of X and Y.
+ * @param schedule Precomputed work partition of a, or nullptr to compute one
+ * with a part per thread for this call.
+ */
+template <typename offset_t, typename index_t>
+void staf_spmm(const staf_matrix<offset_t, index_t> &a, const float *x,
+               float *y, int64_t width,
+               const staf_schedule<offset_t, index_t> *schedule = nullptr);
+
+/**
+ * @brief Element types of the dense matrices accepted by staf_spmm.
+ */
+enum class staf_dtype { float32, float16, bfloat16 };
+
+/**
+ * @brief Mixed precision variant of staf_spmm. X is read in its own
+ * precision and converted to fp32 with SIMD instructions, all partial sums
+ * are accumulated in fp32 and Y is written in its own precision.
+ *
+ * @param a The STAF matrix.
+ * @param x Dense input matrix, one row per column of A.
+ * @param x_dtype Element type of X.
+ * @param y Dense output matrix, one row per row of A. Overwritten.
+ * @param y_dtype Element type of Y.
+ * @param width Number of columns of X and Y.
+ * @param schedule Precomputed work partition of a, or nullptr.
+ */
+template <typename offset_t, typename index_t>
+void staf_spmm(const staf_matrix<offset_t, index_t> &a, const void *x,
+               staf_dtype x_dtype, void *y, staf_dtype y_dtype, int64_t width,
+               const staf_schedule<offset_t, index_t> *schedule = nullptr);
+
+/**
+ * @brief Variant of staf_spmm reading the index arrays from their packed
+ * encodings. Every row and pattern is decoded into a small per-thread buffer
+ * right before it is accumulated, so the indices only travel through memory
+ * in compressed form. The index arrays of a are not accessed.
+ *
+ * @param a The STAF matrix, only its pointer arrays are used.
+ * @param packed Packed encodings of the index arrays of a.
+ * @param x Dense input matrix, one row per column of A.
+ * @param x_dtype Element type of X.
+ * @param y Dense output matrix, one row per row of A. Overwritten.
+ * @param y_dtype Element type of Y.
+ * @param width Number of columns of X and Y.
+ * @param schedule Precomputed work partition of a, or nullptr.
+ */
+template <typename offset_t, typename index_t>
+void staf_spmm(const staf_matrix<offset_t, index_t> &a,
+               const staf_packed_indices<offset_t, index_t> &packed,
+               const void *x, staf_dtype x_dtype, void *y, staf_dtype y_dtype,
+               int64_t width,
+               const staf_schedule<offset_t, index_t> *schedule = nullptr);
+
+/**
+ * @brief Applies a square STAF matrix n_hops times in a single thread team,
+ * as SGC, APPNP and PageRank style propagation do:
+ *
+ *   H_0 = X, H_{t+1} = (1 - alpha) * diag(row_scale) * A * H_t + alpha * X,
+ *   Y = H_{n_hops}.
+ *
+ * The hops in between are kept in fp32 and alternate between two buffers,
+ * one of which is Y itself when Y is fp32. Every hop is one staf_spmm pass;
+ * the hops are only separated by barriers, so no threads are started and no
+ * buffers are allocated per hop.
+ *
+ * @param a The STAF matrix, with as many columns as rows.
+ * @param x Dense input matrix, also the teleport term of every hop.
+ * @param x_dtype Element type of X.
+ * @param y Dense output matrix. Overwritten, must not alias X.
+ * @param y_dtype Element type of Y.
+ * @param width Number of columns of X and Y.
+ * @param n_hops Number of hops, at least one.
+ * @param alpha Teleport probability, 0 for plain powers of A.
+ * @param row_scale Factor of every row of A, such as the inverse degrees for
+ * a random walk, or nullptr for none.
+ * @param schedule Precomputed work partition of a, or nullptr.
+ */
+template <typename offset_t, typename index_t>
+void staf_propagate(const staf_matrix<offset_t, index_t> &a, const void *x,
+                    staf_dtype x_dtype, void *y, staf_dtype y_dtype,
+                    int64_t width, int n_hops, float alpha = 0.0f,
+                    const float *row_scale = nullptr,
+                    const staf_schedule<offset_t, index_t> *schedule = nullptr);
+
+/**
+ * @brief Variant of staf_propagate reading the index arrays from their
+ * packed encodings, see the packed staf_spmm.
+ */
+template <typename offset_t, typename index_t>
+void staf_propagate(const staf_matrix<offset_t, index_t> &a,
+                    const staf_packed_indices<offset_t, index_t> &packed,
+                    const void *x, staf_dtype x_dtype, void *y,
+                    staf_dtype y_dtype, int64_t width, int n_hops,
+                    float alpha = 0.0f, const float *row_scale = nullptr,
+                    const staf_schedule<offset_t, index_t> *schedule = nullptr);
+
+#endif
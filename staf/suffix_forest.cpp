@@ -1,104 +1,354 @@
 #include "suffix_forest.hpp"
+#include <algorithm>
 #include <iostream>
 #include <limits>
+#include <omp.h>
 
-suffix_forest::suffix_forest(size_t nr_tries, size_t score_lambda) {
+namespace {
+// Columns with at least this many rows are inserted into one trie at a time
+// by the whole thread team, unless there are enough tries to keep every
+// thread busy with a trie of its own.
+constexpr size_t hub_column_rows = 4096;
+} // namespace
+
+template <typename offset_t, typename index_t>
+suffix_forest<offset_t, index_t>::suffix_forest(size_t nr_tries,
+                                                size_t score_lambda,
+                                                size_t max_memory,
+                                                size_t nr_candidates,
+                                                double growth_threshold,
+                                                size_t retire_after) {
   this->nr_tries = nr_tries;
   this->score_lambda = score_lambda;
+  this->max_memory = max_memory;
+  this->nr_candidates = nr_candidates;
+  this->growth_threshold = growth_threshold;
+  this->retire_after = retire_after;
 }
 
-size_t suffix_forest::size() const { return tries.size(); }
+template <typename offset_t, typename index_t>
+size_t suffix_forest<offset_t, index_t>::size() const {
+  return tries.size();
+}
 
-suffix_trie *suffix_forest::get_trie(size_t index) {
+template <typename offset_t, typename index_t>
+suffix_trie<index_t> *suffix_forest<offset_t, index_t>::get_trie(size_t index) {
   if (index < tries.size()) {
     return tries[index].get();
   }
   return nullptr;
 }
 
-void suffix_forest::create_forest(const int32_t *col_ptr,
-                                  const int32_t *row_ind, int num_cols) {
-  for (int col = num_cols - 1; col >= 0; col--) {
-    int start = col_ptr[col];
-    int end = col_ptr[col + 1];
-    int count = end - start;
-    std::cout << "iteration " << col << "/" << num_cols - 1 << std::endl;
-
-    const int32_t *rows = &row_ind[start];
-    int selected_trie = false_insert_all(col, rows, count);
-    true_insert(selected_trie);
+template <typename offset_t, typename index_t>
+void suffix_forest<offset_t, index_t>::create_forest(const offset_t *col_ptr,
+                                                     const index_t *row_ind,
+                                                     index_t num_cols) {
+  // Best trie and score among the tries holding rows ([0]) and among the
+  // empty ones ([1]), kept apart for the growth threshold.
+  std::tuple<int, int64_t> global_optimal[2];
+  pending_trie = -1;
+  bool cancelled = false;
+  if (control)
+    control->columns_total = num_cols;
+  if (nr_candidates > 0) {
+    const index_t *end = row_ind + col_ptr[num_cols];
+    n_rows = row_ind != end ? *std::max_element(row_ind, end) + 1 : 0;
   }
-}
-
-int suffix_forest::false_insert_all(int col, const int32_t *rows, int count) {
-  if (tries.size() < this->nr_tries &&
-      (tries.empty() || !tries.back()->is_empty())) {
-    tries.emplace_back(std::make_unique<suffix_trie>());
-  }
-
-  std::tuple<int, int> global_optimal{-1, std::numeric_limits<int>::max()};
 
+  // One thread team for all columns. The commit of a column into the trie it
+  // selected, and the removal of its false nodes from all other tries, is
+  // fused with scoring the next column: each trie is settled and then scored
+  // by the same thread, without a barrier in between.
 #pragma omp parallel
   {
-    std::tuple<int, int> local_optimal{-1, std::numeric_limits<int>::max()};
+    for (index_t col = num_cols - 1; col >= 0; col--) {
+      offset_t start = col_ptr[col];
+      offset_t end = col_ptr[col + 1];
+      offset_t count = end - start;
+      const index_t *rows = &row_ind[start];
+      const long iteration = num_cols - 1 - col;
 
-#pragma omp for nowait
-    for (int i = 0; i < static_cast<int>(tries.size()); ++i) {
-      int score = tries[i]->false_insert(col, rows, count, this->score_lambda);
-      if (score < std::get<1>(local_optimal)) {
-        local_optimal = {i, score};
+#pragma omp single
+      {
+        std::cout << "iteration " << col << "/" << num_cols - 1 << std::endl;
+        if (control) {
+          control->columns_done = iteration;
+          cancelled = control->cancelled;
+        }
+        if (!cancelled) {
+          retire_idle_tries(iteration);
+          size_t speculative_tries =
+              std::min(tries.size() + 1, this->nr_tries);
+          size_t max_scored = enforce_memory_budget(
+              suffix_trie<index_t>::estimate_insert_bytes(count),
+              speculative_tries);
+          if (tries.size() < this->nr_tries &&
+              (tries.empty() || last_used.back() != -1)) {
+            tries.emplace_back(make_trie());
+            last_used.push_back(-1);
+          }
+          select_candidates(rows, count, max_scored);
+          for (auto &optimal : global_optimal)
+            optimal = {-1, std::numeric_limits<int64_t>::max()};
+        }
+      }
+      // The single ends in a barrier, so every thread sees the same flag.
+      if (cancelled)
+        break;
+
+      std::tuple<int, int64_t> local_optimal[2];
+      for (auto &optimal : local_optimal)
+        optimal = {-1, std::numeric_limits<int64_t>::max()};
+      auto consider = [&](int i, int64_t score) {
+        auto &optimal = local_optimal[last_used[i] == -1];
+        if (score < std::get<1>(optimal)) {
+          optimal = {i, score};
+        }
+      };
+      const int n_tries = static_cast<int>(tries.size());
+
+      if (static_cast<size_t>(count) >= hub_column_rows &&
+          n_tries < omp_get_num_threads()) {
+        // Hub column: the whole team inserts it into one trie at a time.
+#pragma omp for
+        for (int i = 0; i < n_tries; ++i) {
+          settle_trie(i);
+        }
+        for (int i = 0; i < n_tries; ++i) {
+          if (!candidate[i])
+            continue;
+          consider(i, tries[i]->false_insert_team(col, rows, count,
+                                                  this->score_lambda));
+        }
+        // The serial rest of every insertion, one trie per thread.
+#pragma omp for schedule(dynamic)
+        for (int i = 0; i < n_tries; ++i) {
+          if (candidate[i])
+            tries[i]->finish_team_insert();
+        }
+      } else {
+#pragma omp for schedule(dynamic) nowait
+        for (int i = 0; i < n_tries; ++i) {
+          settle_trie(i);
+          if (!candidate[i])
+            continue;
+          consider(i, tries[i]->false_insert(col, rows, count,
+                                             this->score_lambda));
+        }
       }
-    }
 
 #pragma omp critical
-    {
-      if (std::get<1>(local_optimal) < std::get<1>(global_optimal)) {
-        global_optimal = local_optimal;
+      {
+        for (int fresh = 0; fresh < 2; fresh++) {
+          if (std::get<1>(local_optimal[fresh]) <
+              std::get<1>(global_optimal[fresh])) {
+            global_optimal[fresh] = local_optimal[fresh];
+          }
+        }
+      }
+#pragma omp barrier
+
+#pragma omp single
+      {
+        // Start a new trie only if it beats the best existing one by the
+        // growth threshold.
+        auto [used, used_score] = global_optimal[0];
+        auto [fresh, fresh_score] = global_optimal[1];
+        pending_trie = used;
+        if (fresh >= 0 &&
+            (used < 0 || used_score > growth_threshold * fresh_score)) {
+          pending_trie = fresh;
+        }
+        peak_memory = std::max(peak_memory, memory_usage());
+        last_used[pending_trie] = iteration;
       }
     }
+
+#pragma omp for
+    for (int i = 0; i < static_cast<int>(tries.size()); ++i) {
+      settle_trie(i);
+    }
   }
+  pending_trie = -1;
+  if (control) {
+    if (!cancelled)
+      control->columns_done = num_cols;
+    control->peak_memory = peak_memory;
+    control->final_memory = memory_usage();
+  }
+}
 
-  return std::get<0>(global_optimal);
+template <typename offset_t, typename index_t>
+std::unique_ptr<suffix_trie<index_t>>
+suffix_forest<offset_t, index_t>::make_trie() const {
+  return std::make_unique<suffix_trie<index_t>>(nr_candidates > 0, n_rows);
 }
 
-void suffix_forest::true_insert(int selected_trie) {
-#pragma omp parallel for
+template <typename offset_t, typename index_t>
+void suffix_forest<offset_t, index_t>::set_control(build_control *control) {
+  this->control = control;
+}
+
+template <typename offset_t, typename index_t>
+void suffix_forest<offset_t, index_t>::select_candidates(const index_t *rows,
+                                                         offset_t count,
+                                                         size_t max_scored) {
+  candidate.assign(tries.size(), (nr_candidates == 0 ||
+                                  tries.size() <= nr_candidates) &&
+                                     tries.size() <= max_scored);
+  if (candidate.empty() || candidate[0])
+    return;
+
+  // Tries that were never selected hold no rows and score alike, one of them
+  // stands for all. The trie selected last is always scored, it usually wins
+  // runs of similar columns.
+  size_t n_scored = 0;
+  auto mark = [&](int i) {
+    if (n_scored < max_scored) {
+      candidate[i] = true;
+      n_scored++;
+    }
+  };
+  std::vector<std::pair<double, int>> ranked;
+  int fresh = -1;
   for (size_t i = 0; i < tries.size(); i++) {
-    if (selected_trie == i) {
-      tries[i]->true_insert();
+    if (last_used[i] == -1) {
+      fresh = i;
+    } else if (static_cast<int>(i) == pending_trie) {
+      mark(i);
+    } else if (nr_candidates > 0) {
+      ranked.emplace_back(-tries[i]->estimate_overlap(rows, count), i);
     } else {
-      tries[i]->delete_false_nodes();
+      ranked.emplace_back(-static_cast<double>(last_used[i]), i);
     }
   }
+  if (fresh >= 0)
+    mark(fresh);
+
+  size_t top = std::min(ranked.size(), max_scored - n_scored);
+  if (nr_candidates > 0)
+    top = std::min(top, nr_candidates);
+  std::partial_sort(ranked.begin(), ranked.begin() + top, ranked.end());
+  for (size_t i = 0; i < top; i++)
+    candidate[ranked[i].second] = true;
 }
 
-binary_csr suffix_forest::build_csr(int n_rows) {
-  std::map<int, std::vector<int>> combined_unique_patterns;
-  std::map<std::vector<int>, std::vector<int>> combined_shared_patterns;
+template <typename offset_t, typename index_t>
+void suffix_forest<offset_t, index_t>::settle_trie(size_t index) {
+  if (static_cast<int>(index) == pending_trie) {
+    tries[index]->true_insert();
+  } else {
+    tries[index]->delete_false_nodes();
+  }
+}
 
-  int max_row = 0;
+template <typename offset_t, typename index_t>
+binary_csr<offset_t, index_t>
+suffix_forest<offset_t, index_t>::build_csr(index_t n_rows, bool with_values) {
+  for (size_t i = 0; i < tries.size(); i++) {
+    freeze_trie(i);
+  }
+  binary_csr<offset_t, index_t> csr(unique_patterns, shared_patterns, n_rows,
+                                    with_values);
+  return csr;
+}
 
+template <typename offset_t, typename index_t>
+size_t suffix_forest<offset_t, index_t>::memory_usage() const {
+  size_t usage = 0;
   for (const auto &trie : tries) {
-    auto up = trie->get_unique_patterns();
-    auto sp = trie->get_shared_patterns();
-
-    for (const auto &[row, cols] : up) {
-      combined_unique_patterns[row].insert(combined_unique_patterns[row].end(),
-                                           cols.begin(), cols.end());
-      if (row > max_row)
-        max_row = row;
-    }
+    usage += trie->memory_usage();
+  }
+  return usage;
+}
+
+template <typename offset_t, typename index_t>
+size_t suffix_forest<offset_t, index_t>::get_peak_memory() const {
+  return peak_memory;
+}
+
+template <typename offset_t, typename index_t>
+void suffix_forest<offset_t, index_t>::freeze_trie(size_t index) {
+  settle_trie(index);
+  auto up = tries[index]->get_unique_patterns();
+  auto sp = tries[index]->get_shared_patterns();
+
+  for (const auto &[row, cols] : up) {
+    unique_patterns[row].insert(unique_patterns[row].end(), cols.begin(),
+                                cols.end());
+  }
+
+  for (const auto &[key, val] : sp) {
+    shared_patterns[key].insert(shared_patterns[key].end(), val.begin(),
+                                val.end());
+  }
+
+  tries[index] = make_trie();
+  last_used[index] = -1;
+}
+
+template <typename offset_t, typename index_t>
+size_t suffix_forest<offset_t, index_t>::enforce_memory_budget(
+    size_t insert_bytes, size_t n_scored) {
+  if (max_memory == 0 ||
+      memory_usage() + n_scored * insert_bytes <= max_memory)
+    return n_scored;
 
-    for (const auto &[key, val] : sp) {
-      combined_shared_patterns[key].insert(combined_shared_patterns[key].end(),
-                                           val.begin(), val.end());
+  // Speculative nodes of the last column do not count against the budget.
+  for (size_t i = 0; i < tries.size(); i++) {
+    settle_trie(i);
+  }
+
+  size_t usage = memory_usage();
+  while (usage + n_scored * insert_bytes > max_memory) {
+    int coldest = -1;
+    for (size_t i = 0; i < tries.size(); i++) {
+      if (tries[i]->is_empty())
+        continue;
+      if (coldest < 0 || last_used[i] < last_used[coldest])
+        coldest = i;
     }
+    if (coldest < 0)
+      break;
+    freeze_trie(coldest);
+    usage = memory_usage();
+  }
+  if (usage + n_scored * insert_bytes <= max_memory)
+    return n_scored;
+
+  // Even with all tries finalized the column does not fit n_scored times:
+  // score it against fewer tries.
+  size_t fit = usage < max_memory && insert_bytes > 0
+                   ? (max_memory - usage) / insert_bytes
+                   : 0;
+  if (fit == 0 && !budget_warned) {
+    std::cerr << "warning: max_memory of " << max_memory
+              << " bytes is too small to insert a column of " << insert_bytes
+              << " bytes, the budget will be exceeded" << std::endl;
+    budget_warned = true;
+  }
+  return std::max<size_t>(fit, 1);
+}
+
+template <typename offset_t, typename index_t>
+void suffix_forest<offset_t, index_t>::retire_idle_tries(long iteration) {
+  if (retire_after == 0)
+    return;
+
+  for (size_t i = tries.size(); i-- > 0;) {
+    if (last_used[i] == -1 ||
+        iteration - last_used[i] <= static_cast<long>(retire_after))
+      continue;
+    freeze_trie(i);
+    tries.erase(tries.begin() + i);
+    last_used.erase(last_used.begin() + i);
+    if (pending_trie > static_cast<int>(i))
+      pending_trie--;
   }
-  binary_csr csr(combined_unique_patterns, combined_shared_patterns, n_rows);
-  return csr;
 }
 
-void suffix_forest::print_forest() {
+template <typename offset_t, typename index_t>
+void suffix_forest<offset_t, index_t>::print_forest() {
   for (size_t i = 0; i < tries.size(); i++) {
     std::cout << "Trie nr " << i << std::endl;
     tries[i]->print_trie();
@@ -106,3 +356,7 @@ void suffix_forest::print_forest() {
     tries[i]->get_shared_patterns();
   }
 }
+
+template class suffix_forest<int32_t, int32_t>;
+template class suffix_forest<int64_t, int32_t>;
+template class suffix_forest<int64_t, int64_t>;
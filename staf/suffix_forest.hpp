@@ -3,16 +3,61 @@
 
 #include "binary_csr.hpp"
 #include "suffix_trie.hpp"
+#include <atomic>
 #include <cstdint>
+#include <map>
 #include <memory>
 #include <vector>
 
+/**
+ * @struct build_control
+ * @brief Progress and cancellation of a forest build running on another
+ * thread. create_forest publishes the number of columns it has inserted,
+ * stops at the next column once cancelled is set and reports the memory held
+ * by its tries when it returns.
+ */
+struct build_control {
+  std::atomic<int64_t> columns_done{0};
+  std::atomic<int64_t> columns_total{0};
+  std::atomic<bool> cancelled{false};
+  std::atomic<size_t> peak_memory{0};  ///< Set once the forest is built
+  std::atomic<size_t> final_memory{0}; ///< Set once the forest is built
+};
+
+/**
+ * @class suffix_forest
+ * @brief Set of suffix tries built from the columns of a CSC matrix.
+ *
+ * @tparam offset_t Integer type of the column pointers and of the offsets in
+ * the produced CSR arrays.
+ * @tparam index_t Integer type of the row and column indices.
+ */
+template <typename offset_t = int32_t, typename index_t = int32_t>
 class suffix_forest {
 public:
   /**
    * @brief Constructs an empty suffix_forest.
+   *
+   * @param nr_tries Maximum number of tries kept alive at the same time.
+   * @param score_lambda Weight of a new node in the insertion score.
+   * @param max_memory Budget in bytes for the live tries, 0 for no limit. When
+   * it would be exceeded, the least recently selected trie is finalized: its
+   * patterns are moved to the output buffers and a fresh trie takes its slot.
+   * The output buffers are part of the result and do not count against the
+   * budget.
+   * @param nr_candidates Number of tries scored exactly per column, 0 for
+   * all. The candidates are the tries whose row sketches overlap most with
+   * the rows of the column, plus the trie selected last and an empty trie.
+   * @param growth_threshold A column starts a new trie only if the best score
+   * among the non-empty tries exceeds this multiple of the score of an empty
+   * trie. 1 starts a new trie whenever it scores best, larger values keep
+   * the forest smaller.
+   * @param retire_after Number of iterations after which a trie that has not
+   * been selected is finalized and its slot dropped, 0 to keep all tries.
    */
-  suffix_forest(size_t nr_tries, size_t score_lambda);
+  suffix_forest(size_t nr_tries, size_t score_lambda, size_t max_memory = 0,
+                size_t nr_candidates = 0, double growth_threshold = 1.0,
+                size_t retire_after = 0);
 
   /**
    * @brief Returns the number of suffix tries in the forest.
@@ -25,7 +70,7 @@ public:
    * @param index The index of the trie to retrieve.
    * @return Pointer to the suffix_trie at the given index.
    */
-  suffix_trie *get_trie(size_t index);
+  suffix_trie<index_t> *get_trie(size_t index);
 
   /**
    * @brief Build the forest of suffix tries from a CSC sparse matrix's column
@@ -37,8 +82,17 @@ public:
    * non-zero entries.
    * @param num_cols Number of columns in the matrix.
    */
-  void create_forest(const int32_t *col_ptr, const int32_t *row_ind,
-                     int num_cols);
+  void create_forest(const offset_t *col_ptr, const index_t *row_ind,
+                     index_t num_cols);
+
+  /**
+   * @brief Reports the progress of create_forest to control and lets it
+   * cancel the build. A cancelled build leaves the forest with the columns
+   * inserted so far.
+   * @param control Shared control block, nullptr to detach. Must outlive the
+   * build.
+   */
+  void set_control(build_control *control);
 
   /**
    * @brief Builds a binary CSR matrix from the unique and shared patterns
@@ -51,10 +105,27 @@ public:
    * It then merges these patterns into a unified representation and uses them
    * to construct a `binary_csr` object.
    *
+   * @param n_rows Number of rows of the matrix.
+   * @param with_values Whether the CSR stores its all-ones value arrays.
    * @return A `binary_csr` instance representing the sparse matrix formed from
    *         the combined unique and shared patterns.
    */
-  binary_csr build_csr(int n_rows);
+  binary_csr<offset_t, index_t> build_csr(index_t n_rows,
+                                          bool with_values = true);
+
+  /**
+   * @brief Returns the estimated memory currently held by the live tries.
+   * @return Size in bytes.
+   */
+  size_t memory_usage() const;
+
+  /**
+   * @brief Returns the highest memory held by the live tries during
+   * construction, speculative insertions included. The patterns already
+   * moved to the output buffers are not counted.
+   * @return Size in bytes.
+   */
+  size_t get_peak_memory() const;
 
   /**
    * @brief Print a representation of the entire suffix forest to stdout.
@@ -65,30 +136,102 @@ public:
 private:
   size_t nr_tries;
   size_t score_lambda;
+  size_t max_memory;
+  size_t nr_candidates;
+  double growth_threshold;
+  size_t retire_after;
+  size_t peak_memory = 0;
+  build_control *control = nullptr;
   /**
    * @brief Container holding the suffix tries in the forest.
    * Each suffix_trie corresponds to a structure built from matrix columns.
    */
-  std::vector<std::unique_ptr<suffix_trie>> tries;
+  std::vector<std::unique_ptr<suffix_trie<index_t>>> tries;
 
   /**
-   * @brief Attempts to insert a block of rows into the forest as "false"
-   * inserts. Used internally for forest construction.
-   *
-   * @param col The current column index being processed.
-   * @param rows Pointer to the array of row indices to insert.
-   * @param count Number of rows to insert.
-   * @return An integer status or identifier related to insertion
-   * success/failure.
+   * @brief Iteration in which each trie was last selected, -1 if never.
+   * Used to pick the coldest trie when the memory budget is reached.
+   */
+  std::vector<long> last_used;
+
+  /**
+   * @brief Output buffers holding the patterns of finalized tries.
+   */
+  std::map<index_t, std::vector<index_t>> unique_patterns;
+  std::map<std::vector<index_t>, std::vector<index_t>> shared_patterns;
+
+  /**
+   * @brief Moves the patterns of a trie to the output buffers and replaces it
+   * with an empty trie.
+   * @param index Index of the trie to finalize.
+   */
+  void freeze_trie(size_t index);
+
+  /**
+   * @brief Finalizes the least recently selected tries until the live tries
+   * plus the speculative insertion of the next column into n_scored tries fit
+   * into the memory budget. If they do not fit even with every trie
+   * finalized, fewer tries are scored.
+   * @param insert_bytes Bytes of inserting the next column into one trie.
+   * @param n_scored Number of tries the column would be inserted into.
+   * @return Number of tries the column may be inserted into, at least 1.
+   */
+  size_t enforce_memory_budget(size_t insert_bytes, size_t n_scored);
+
+  /**
+   * @brief Whether the budget was found too small for a single column.
+   */
+  bool budget_warned = false;
+
+  /**
+   * @brief Trie selected for the last scored column whose commit is still
+   * outstanding, -1 if none. All other tries still hold the false nodes of
+   * that column.
+   */
+  int pending_trie = -1;
+
+  /**
+   * @brief Finalizes the tries not selected within the last retire_after
+   * iterations and removes them from the forest.
+   * @param iteration Number of columns processed so far.
+   */
+  void retire_idle_tries(long iteration);
+
+  /**
+   * @brief Whether each trie is scored for the current column.
+   */
+  std::vector<char> candidate;
+
+  /**
+   * @brief Number of rows of the matrix being inserted, sizes the row
+   * sketches of new tries.
+   */
+  size_t n_rows = 0;
+
+  /**
+   * @brief Creates an empty trie, with a row sketch if candidates are
+   * selected.
+   */
+  std::unique_ptr<suffix_trie<index_t>> make_trie() const;
+
+  /**
+   * @brief Marks the tries to score for a column, see nr_candidates.
+   * @param rows Pointer to the array of row indices of the column.
+   * @param count Number of rows in the column.
+   * @param max_scored Most tries to mark. When it is the limit, the trie
+   * selected last comes first, then an empty trie, then the others by
+   * overlap, or by recency without sketches.
    */
-  int false_insert_all(int col, const int32_t *rows, int count);
+  void select_candidates(const index_t *rows, offset_t count,
+                         size_t max_scored);
 
   /**
-   * @brief Performs a "true" insertion in the selected trie after certain
-   * checks. For all other tries, delete the temporary inserted nodes.
-   * @param selected_trie Index of the trie to insert into.
+   * @brief Brings a trie up to date with the last scored column: commits the
+   * column if the trie was selected for it, otherwise deletes its false nodes.
+   * Does nothing on a trie without false nodes.
+   * @param index Index of the trie to settle.
    */
-  void true_insert(int selected_trie);
+  void settle_trie(size_t index);
 };
 
 #endif
@@ -1,9 +1,48 @@
 #include "suffix_trie.hpp"
+#include <algorithm>
 #include <iostream>
+#include <omp.h>
 
-suffix_trie::suffix_trie() : root(std::make_unique<trie_node>()) {}
+namespace {
+// Rough per-element heap costs used for memory accounting: a node plus its
+// slot in the parent's children vector, a red-black tree node of a row set and
+// a node of an unordered_map (value, next pointer and bucket pointer).
+template <typename index_t>
+constexpr size_t node_bytes =
+    sizeof(trie_node<index_t>) + sizeof(std::unique_ptr<trie_node<index_t>>);
+template <typename index_t>
+constexpr size_t row_bytes = sizeof(index_t) + 4 * sizeof(void *);
+template <typename index_t>
+constexpr size_t map_entry_bytes =
+    sizeof(std::pair<const index_t, trie_node<index_t> *>) +
+    2 * sizeof(void *);
 
-void suffix_trie::true_insert_node(trie_node *node, trie_node *parent) {
+// Row sketches hold one bit per row up to 2^23 rows (1 MiB); larger
+// matrices hash their rows into that many bits. Without a row count the
+// sketch hashes into 2^16 bits.
+constexpr int max_sketch_log_bits = 23;
+constexpr int default_sketch_log_bits = 16;
+} // namespace
+
+template <typename index_t>
+suffix_trie<index_t>::suffix_trie(bool with_sketch, size_t n_rows)
+    : root(std::make_unique<node_t>()), with_sketch(with_sketch) {
+  sketch_exact = n_rows > 0 && n_rows <= (size_t{1} << max_sketch_log_bits);
+  sketch_log_bits = n_rows > 0 ? max_sketch_log_bits : default_sketch_log_bits;
+  sketch_bits = sketch_exact ? (n_rows + 63) / 64 * 64
+                             : size_t{1} << sketch_log_bits;
+}
+
+template <typename index_t>
+size_t suffix_trie<index_t>::sketch_slot(index_t row) const {
+  if (sketch_exact)
+    return static_cast<size_t>(row);
+  return (static_cast<uint64_t>(row) * 0x9E3779B97F4A7C15ull) >>
+         (64 - sketch_log_bits);
+}
+
+template <typename index_t>
+void suffix_trie<index_t>::true_insert_node(node_t *node, node_t *parent) {
   for (auto &child : node->get_children()) {
     true_insert_node(child.get(), node);
   }
@@ -12,14 +51,15 @@ void suffix_trie::true_insert_node(trie_node *node, trie_node *parent) {
     node->true_insert();
 
     if (parent) {
-      for (int row : node->get_row_numbers()) {
+      for (index_t row : node->get_row_numbers()) {
         parent->remove_row(row);
       }
     }
   }
 }
 
-void suffix_trie::delete_false_node(trie_node *node) {
+template <typename index_t>
+void suffix_trie<index_t>::delete_false_node(node_t *node) {
   if (!node)
     return;
   for (const auto &child : node->get_children()) {
@@ -28,29 +68,31 @@ void suffix_trie::delete_false_node(trie_node *node) {
   node->remove_child_if_false_inserted();
 }
 
-std::set<int> suffix_trie::build_patterns_bottom_up(
-    const trie_node *node,
-    std::map<std::vector<int>, std::vector<int>> &patterns) {
-  std::set<int> current_rows = node->get_row_numbers();
+template <typename index_t>
+std::set<index_t> suffix_trie<index_t>::build_patterns_bottom_up(
+    const node_t *node,
+    std::map<std::vector<index_t>, std::vector<index_t>> &patterns) {
+  std::set<index_t> current_rows = node->get_row_numbers();
   bool is_shared = node->is_shared();
   bool is_leaf = node->get_children().empty();
 
   for (const auto &child : node->get_children()) {
-    std::set<int> child_rows = build_patterns_bottom_up(child.get(), patterns);
+    std::set<index_t> child_rows =
+        build_patterns_bottom_up(child.get(), patterns);
     current_rows.insert(child_rows.begin(), child_rows.end());
   }
 
   if (is_shared || (is_leaf && current_rows.size() > 1)) {
-    std::vector<int> current_pattern;
+    std::vector<index_t> current_pattern;
     if (node->get_index() >= 0) {
       current_pattern.push_back(node->get_index());
     }
-    std::vector<int> key(current_rows.begin(), current_rows.end());
+    std::vector<index_t> key(current_rows.begin(), current_rows.end());
     if (!current_pattern.empty()) {
       patterns[key] = current_pattern;
     }
   } else if (current_rows.size() > 1) {
-    std::vector<int> key(current_rows.begin(), current_rows.end());
+    std::vector<index_t> key(current_rows.begin(), current_rows.end());
     auto it = patterns.find(key);
     if (it != patterns.end() && node->get_index() >= 0) {
       it->second.push_back(node->get_index());
@@ -59,14 +101,16 @@ std::set<int> suffix_trie::build_patterns_bottom_up(
   return current_rows;
 }
 
-std::set<int> suffix_trie::build_patterns_bottom_up_unique(
-    const trie_node *node, std::map<int, std::vector<int>> &patterns) const {
-  std::set<int> current_rows = node->get_row_numbers();
+template <typename index_t>
+std::set<index_t> suffix_trie<index_t>::build_patterns_bottom_up_unique(
+    const node_t *node,
+    std::map<index_t, std::vector<index_t>> &patterns) const {
+  std::set<index_t> current_rows = node->get_row_numbers();
   bool is_shared = node->is_shared();
   bool is_leaf = node->get_children().empty();
 
   for (const auto &child : node->get_children()) {
-    std::set<int> child_rows =
+    std::set<index_t> child_rows =
         build_patterns_bottom_up_unique(child.get(), patterns);
     current_rows.insert(child_rows.begin(), child_rows.end());
   }
@@ -75,14 +119,14 @@ std::set<int> suffix_trie::build_patterns_bottom_up_unique(
     return current_rows;
   }
   if (current_rows.size() == 1 && is_leaf) {
-    std::vector<int> current_pattern;
+    std::vector<index_t> current_pattern;
     if (node->get_index() >= 0) {
       current_pattern.push_back(node->get_index());
     }
-    int key = *current_rows.begin();
+    index_t key = *current_rows.begin();
     patterns[key] = current_pattern;
   } else if (current_rows.size() == 1) {
-    int key = *current_rows.begin();
+    index_t key = *current_rows.begin();
     auto it = patterns.find(key);
     if (it != patterns.end() && node->get_index() >= 0) {
       it->second.push_back(node->get_index());
@@ -91,8 +135,10 @@ std::set<int> suffix_trie::build_patterns_bottom_up_unique(
   return current_rows;
 }
 
-void suffix_trie::print_node(const trie_node *node, const std::string &prefix,
-                             bool is_last) const {
+template <typename index_t>
+void suffix_trie<index_t>::print_node(const node_t *node,
+                                      const std::string &prefix,
+                                      bool is_last) const {
   std::cout << prefix << (is_last ? "└── " : "├── ");
   std::cout << (node->get_index() == -1
                     ? "ROOT"
@@ -100,7 +146,7 @@ void suffix_trie::print_node(const trie_node *node, const std::string &prefix,
 
   if (!node->get_row_numbers().empty()) {
     std::cout << " (rows:";
-    for (int row : node->get_row_numbers())
+    for (index_t row : node->get_row_numbers())
       std::cout << " " << row;
     std::cout << ")";
   }
@@ -113,50 +159,57 @@ void suffix_trie::print_node(const trie_node *node, const std::string &prefix,
   }
 }
 
-std::map<std::vector<int>, std::vector<int>>
-suffix_trie::get_shared_patterns() {
-  std::map<std::vector<int>, std::vector<int>> patterns;
+template <typename index_t>
+std::map<std::vector<index_t>, std::vector<index_t>>
+suffix_trie<index_t>::get_shared_patterns() {
+  std::map<std::vector<index_t>, std::vector<index_t>> patterns;
   build_patterns_bottom_up(root.get(), patterns);
   return patterns;
 }
 
-std::map<int, std::vector<int>> suffix_trie::get_unique_patterns() {
-  std::map<int, std::vector<int>> patterns;
+template <typename index_t>
+std::map<index_t, std::vector<index_t>>
+suffix_trie<index_t>::get_unique_patterns() {
+  std::map<index_t, std::vector<index_t>> patterns;
   build_patterns_bottom_up_unique(root.get(), patterns);
   return patterns;
 }
 
-int suffix_trie::false_insert(int col, const int32_t *rows, int size,
-                              size_t score_lambda) {
-  int new_nodes = 0;
-  int new_rows = 0;
+template <typename index_t>
+int64_t suffix_trie<index_t>::false_insert(index_t col, const index_t *rows,
+                                           size_t size, size_t score_lambda) {
+  int64_t new_nodes = 0;
+  int64_t new_rows = 0;
 
-  for (int i = 0; i < size; i++) {
-    int32_t row = rows[i];
-    trie_node *node = true_insert_map[row];
+  for (size_t i = 0; i < size; i++) {
+    index_t row = rows[i];
+    auto found = true_insert_map.find(row);
+    node_t *node = found != true_insert_map.end() ? found->second : nullptr;
     if (!node) {
       node = root.get();
       if (node->has_child(col)) {
-        trie_node *child = node->get_child(col);
+        node_t *child = node->get_child(col);
         child->add_row_number(row);
         this->false_insert_map[row] = child;
         new_rows++;
       } else {
-        trie_node *inserted_node = node->add_child(col, true);
+        node_t *inserted_node = node->add_child(col, true);
         this->false_insert_map[row] = inserted_node;
         inserted_node->add_row_number(row);
+        nr_nodes++;
         new_nodes++;
         new_rows++;
       }
     } else {
       if (node->has_child(col)) {
-        trie_node *child = node->get_child(col);
+        node_t *child = node->get_child(col);
         this->false_insert_map[row] = child;
         child->add_row_number(row);
       } else {
-        trie_node *inserted_node = node->add_child(col, true);
+        node_t *inserted_node = node->add_child(col, true);
         this->false_insert_map[row] = inserted_node;
         inserted_node->add_row_number(row);
+        nr_nodes++;
         new_nodes++;
       }
     }
@@ -165,14 +218,156 @@ int suffix_trie::false_insert(int col, const int32_t *rows, int size,
   return new_nodes * score_lambda + new_rows;
 }
 
-void suffix_trie::true_insert() {
+template <typename index_t>
+int64_t suffix_trie<index_t>::false_insert_team(index_t col,
+                                                const index_t *rows,
+                                                size_t size,
+                                                size_t score_lambda) {
+  const int nr_threads = omp_get_num_threads();
+  const int thread = omp_get_thread_num();
+
+#pragma omp single
+  {
+    team_buckets.resize(nr_threads);
+    for (auto &buckets : team_buckets)
+      buckets.resize(nr_threads);
+    team_roots.resize(nr_threads);
+    team_inserts.resize(nr_threads);
+    team_root_child = nullptr;
+    team_score = 0;
+  }
+
+  // Bucket every row already in the trie by the node it ends in. The low
+  // bits of a node address are alignment, the multiplication mixes the
+  // others into the high bits.
+  auto &buckets = team_buckets[thread];
+  for (auto &bucket : buckets) {
+    bucket.clear();
+    bucket.reserve(size / (static_cast<size_t>(nr_threads) * nr_threads) + 1);
+  }
+  auto &new_rows = team_roots[thread];
+  new_rows.clear();
+#pragma omp for schedule(static)
+  for (size_t i = 0; i < size; i++) {
+    auto found = true_insert_map.find(rows[i]);
+    if (found == true_insert_map.end()) {
+      new_rows.push_back(rows[i]);
+      continue;
+    }
+    node_t *node = found->second;
+    uint64_t hash = (reinterpret_cast<uintptr_t>(node) >> 4) *
+                    0x9E3779B97F4A7C15ull;
+    buckets[(hash >> 32) % nr_threads].emplace_back(rows[i], node);
+  }
+
+#pragma omp single
+  {
+    size_t nr_new_rows = 0;
+    for (const auto &roots : team_roots)
+      nr_new_rows += roots.size();
+    if (nr_new_rows > 0) {
+      int64_t new_nodes = 0;
+      team_root_child = root->get_child(col);
+      if (!team_root_child) {
+        team_root_child = root->add_child(col, true);
+        new_nodes++;
+      }
+      nr_nodes += new_nodes;
+      team_score += new_nodes * static_cast<int64_t>(score_lambda) +
+                    static_cast<int64_t>(nr_new_rows);
+    }
+  }
+
+  // Each thread owns the parents hashed to it, so the children it creates
+  // and the row sets it fills are not touched by any other thread.
+  auto &inserts = team_inserts[thread];
+  inserts.clear();
+  inserts.reserve(size / nr_threads + 1);
+  int64_t new_nodes = 0;
+  for (int source = 0; source < nr_threads; source++) {
+    for (auto [row, node] : team_buckets[source][thread]) {
+      node_t *child = node->get_child(col);
+      if (!child) {
+        child = node->add_child(col, true);
+        new_nodes++;
+      }
+      child->add_row_number(row);
+      inserts.emplace_back(row, child);
+    }
+  }
+
+#pragma omp atomic
+  team_score += new_nodes * static_cast<int64_t>(score_lambda);
+#pragma omp atomic
+  nr_nodes += new_nodes;
+#pragma omp barrier
+
+  return team_score;
+}
+
+template <typename index_t> void suffix_trie<index_t>::finish_team_insert() {
+  size_t size = 0;
+  for (const auto &thread_inserts : team_inserts)
+    size += thread_inserts.size();
+  for (const auto &roots : team_roots)
+    size += roots.size();
+  false_insert_map.reserve(false_insert_map.size() + size);
+
+  for (auto &thread_inserts : team_inserts) {
+    false_insert_map.insert(thread_inserts.begin(), thread_inserts.end());
+    thread_inserts.clear();
+  }
+  // The threads looked up consecutive ranges of the ascending rows, so the
+  // new rows arrive in order and every set insertion is a hinted append.
+  for (auto &roots : team_roots) {
+    for (index_t row : roots) {
+      team_root_child->add_row_number(row);
+      false_insert_map.emplace(row, team_root_child);
+    }
+    roots.clear();
+  }
+  team_root_child = nullptr;
+}
+
+template <typename index_t>
+double suffix_trie<index_t>::estimate_overlap(const index_t *rows,
+                                              size_t size) const {
+  if (sketch_fill == 0)
+    return 0;
+
+  size_t hits = 0;
+  for (size_t i = 0; i < size; i++) {
+    size_t slot = sketch_slot(rows[i]);
+    hits += (row_sketch[slot / 64] >> (slot % 64)) & 1;
+  }
+  if (sketch_exact)
+    return static_cast<double>(hits);
+  // Each absent row still hits a set bit with probability fill.
+  double fill = static_cast<double>(sketch_fill) / sketch_bits;
+  if (fill >= 1.0)
+    return static_cast<double>(hits);
+  return std::max(0.0, (hits - size * fill) / (1.0 - fill));
+}
+
+template <typename index_t> void suffix_trie<index_t>::true_insert() {
+  if (with_sketch) {
+    if (row_sketch.empty())
+      row_sketch.resize(sketch_bits / 64);
+    for (const auto &entry : false_insert_map) {
+      size_t slot = sketch_slot(entry.first);
+      uint64_t bit = uint64_t{1} << (slot % 64);
+      sketch_fill += (row_sketch[slot / 64] & bit) == 0;
+      row_sketch[slot / 64] |= bit;
+    }
+  }
+
   for (auto &[row, node] : false_insert_map) {
     // Promote the node to true
     node->true_insert();
     true_insert_map[row] = node;
 
     // Remove this row from the parent
-    trie_node *parent = node->get_parent();
+    node_t *parent = node->get_parent();
     if (parent) {
       parent->remove_row(row);
     }
@@ -181,26 +376,41 @@ void suffix_trie::true_insert() {
   this->false_insert_map.clear();
 }
 
-void suffix_trie::delete_false_nodes() {
-  std::set<trie_node *> parents_to_clean;
+template <typename index_t> void suffix_trie<index_t>::delete_false_nodes() {
+  std::set<node_t *> parents_to_clean;
 
   for (auto &[row, false_node] : false_insert_map) {
-    trie_node *parent = false_node->get_parent();
+    node_t *parent = false_node->get_parent();
     if (parent) {
       parents_to_clean.insert(parent);
     }
   }
 
   for (auto parent : parents_to_clean) {
-    parent->remove_child_if_false_inserted();
+    nr_nodes -= parent->remove_child_if_false_inserted();
   }
 
   false_insert_map.clear();
 }
 
-bool suffix_trie::is_empty() { return root->is_empty(); }
+template <typename index_t> bool suffix_trie<index_t>::is_empty() {
+  return root->is_empty();
+}
 
-void suffix_trie::print_trie() {
+template <typename index_t> size_t suffix_trie<index_t>::memory_usage() const {
+  size_t rows = true_insert_map.size() + false_insert_map.size();
+  return (nr_nodes + 1) * node_bytes<index_t> +
+         rows * (row_bytes<index_t> + map_entry_bytes<index_t>) +
+         row_sketch.size() * sizeof(uint64_t);
+}
+
+template <typename index_t>
+size_t suffix_trie<index_t>::estimate_insert_bytes(size_t size) {
+  return size * (node_bytes<index_t> + row_bytes<index_t> +
+                 map_entry_bytes<index_t>);
+}
+
+template <typename index_t> void suffix_trie<index_t>::print_trie() {
   if (!root) {
     std::cout << "Trie is empty" << std::endl;
     return;
@@ -208,3 +418,6 @@ void suffix_trie::print_trie() {
   std::cout << "Suffix Trie Structure:" << std::endl;
   print_node(root.get(), "", true);
 }
+
+template class suffix_trie<int32_t>;
+template class suffix_trie<int64_t>;
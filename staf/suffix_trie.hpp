@@ -10,13 +10,62 @@
 #include <unordered_map>
 #include <vector>
 
-class suffix_trie {
+/**
+ * @class suffix_trie
+ * @brief Trie of column suffixes shared between the rows of a sparse matrix.
+ *
+ * @tparam index_t Integer type of the row and column indices.
+ */
+template <typename index_t = int32_t> class suffix_trie {
 private:
+  using node_t = trie_node<index_t>;
+
   /**
    * @brief The root node of the suffix trie.
    * Uses unique_ptr for automatic memory management.
    */
-  std::unique_ptr<trie_node> root;
+  std::unique_ptr<node_t> root;
+
+  /**
+   * @brief Number of nodes currently allocated in the trie, root excluded.
+   * Speculative ("false") nodes are included until they are deleted.
+   */
+  size_t nr_nodes = 0;
+
+  /**
+   * @brief Whether true_insert maintains the row sketch.
+   */
+  bool with_sketch;
+
+  /**
+   * @brief Bitset of the rows in true_insert_map and its number of set bits.
+   * Rows never leave a trie, so the sketch only ever gains bits. It has one
+   * bit per row when the row count allows, otherwise rows are hashed into
+   * 2^sketch_log_bits bits.
+   */
+  std::vector<uint64_t> row_sketch;
+  size_t sketch_fill = 0;
+  size_t sketch_bits;
+  int sketch_log_bits;
+  bool sketch_exact;
+
+  /**
+   * @brief Bit of a row in the sketch.
+   */
+  size_t sketch_slot(index_t row) const;
+
+  /**
+   * @brief Scratch space of false_insert_team: the rows already in the trie
+   * with their node, bucketed by the source and destination thread, the rows
+   * new to the trie per source thread, the child of the root they go to, the
+   * (row, node) pairs each thread inserted and the accumulated score.
+   */
+  std::vector<std::vector<std::vector<std::pair<index_t, node_t *>>>>
+      team_buckets;
+  std::vector<std::vector<index_t>> team_roots;
+  node_t *team_root_child = nullptr;
+  std::vector<std::vector<std::pair<index_t, node_t *>>> team_inserts;
+  int64_t team_score = 0;
 
   /**
    * @brief Helper function to perform a "true" insertion of a node into the
@@ -25,14 +74,14 @@ private:
    * @param node Pointer to the node to insert.
    * @param parent Optional pointer to the parent node; nullptr if root-level.
    */
-  void true_insert_node(trie_node *node, trie_node *parent = nullptr);
+  void true_insert_node(node_t *node, node_t *parent = nullptr);
 
   /**
    * @brief Recursively delete nodes marked as "false" insertions.
    *
    * @param node Pointer to the node to delete.
    */
-  void delete_false_node(trie_node *node);
+  void delete_false_node(node_t *node);
 
   /**
    * @brief Builds shared patterns bottom-up from the trie starting at a given
@@ -43,9 +92,9 @@ private:
    * vectors
    * @return Set of rows of the previous node.
    */
-  std::set<int> build_patterns_bottom_up(
-      const trie_node *node,
-      std::map<std::vector<int>, std::vector<int>> &patterns);
+  std::set<index_t> build_patterns_bottom_up(
+      const node_t *node,
+      std::map<std::vector<index_t>, std::vector<index_t>> &patterns);
 
   /**
    * @brief Builds unique patterns bottom-up, associating  row indeces to unique
@@ -56,8 +105,9 @@ private:
    * vector.
    * @return Set of rows of the previous node.
    */
-  std::set<int> build_patterns_bottom_up_unique(
-      const trie_node *node, std::map<int, std::vector<int>> &patterns) const;
+  std::set<index_t> build_patterns_bottom_up_unique(
+      const node_t *node,
+      std::map<index_t, std::vector<index_t>> &patterns) const;
 
   /**
    * @brief Recursively prints the trie nodes for visualization/debugging.
@@ -67,24 +117,29 @@ private:
    * @param is_last Boolean indicating if the current node is the last sibling
    * (for formatting).
    */
-  void print_node(const trie_node *node, const std::string &prefix,
+  void print_node(const node_t *node, const std::string &prefix,
                   bool is_last) const;
 
 public:
   /**
    * @brief Constructs an empty suffix_trie.
+   *
+   * @param with_sketch Whether to keep a sketch of the rows in the trie for
+   * estimate_overlap.
+   * @param n_rows Number of rows of the matrix, sizes the sketch. 0 if
+   * unknown.
    */
-  suffix_trie();
+  suffix_trie(bool with_sketch = false, size_t n_rows = 0);
 
-  std::unordered_map<int32_t, trie_node *> false_insert_map;
-  std::unordered_map<int32_t, trie_node *> true_insert_map;
+  std::unordered_map<index_t, node_t *> false_insert_map;
+  std::unordered_map<index_t, node_t *> true_insert_map;
   /**
    * @brief Extracts and returns shared patterns in the trie.
    *
    * @return A map where keys are a vector of rows and values are the shared
    * column indeces.
    */
-  std::map<std::vector<int>, std::vector<int>> get_shared_patterns();
+  std::map<std::vector<index_t>, std::vector<index_t>> get_shared_patterns();
 
   /**
    * @brief Extracts and returns unique patterns from the trie.
@@ -92,7 +147,7 @@ public:
    * @return A map where keys are row numbers and values are the unique column
    * indeces for the rows
    */
-  std::map<int, std::vector<int>> get_unique_patterns();
+  std::map<index_t, std::vector<index_t>> get_unique_patterns();
 
   /**
    * @brief Attempts to insert rows into the trie as "false" insertions.
@@ -103,7 +158,50 @@ public:
    * @param size Number of rows to insert.
    * @return Calculated score for the column insertion.
    */
-  int false_insert(int col, const int32_t *rows, int size, size_t score_lambda);
+  int64_t false_insert(index_t col, const index_t *rows, size_t size,
+                       size_t score_lambda);
+
+  /**
+   * @brief Team variant of false_insert for columns with many rows. Must be
+   * called by all threads of the enclosing OpenMP parallel region (or outside
+   * of one, by a single thread), each thread returns the same score.
+   * finish_team_insert must be called before the trie is used otherwise.
+   *
+   * Rows already in the trie are bucketed by a hash of the node they end in,
+   * so all rows under the same parent are handled by one thread, which
+   * creates the children of its parents without locking. Rows new to the
+   * trie all go to one child of the root, created once; they stay with the
+   * thread that looked them up. The new entries of false_insert_map are
+   * collected in per-thread buffers.
+   *
+   * @param col The current column index for insertion.
+   * @param rows Pointer to the array of distinct, ascending row indices.
+   * @param size Number of rows to insert.
+   * @return Calculated score for the column insertion.
+   */
+  int64_t false_insert_team(index_t col, const index_t *rows, size_t size,
+                            size_t score_lambda);
+
+  /**
+   * @brief Completes false_insert_team: moves the buffered entries into
+   * false_insert_map and the rows new to the trie into their child of the
+   * root. Called by a single thread; different tries can be finished by
+   * different threads at the same time.
+   */
+  void finish_team_insert();
+
+  /**
+   * @brief Estimates from the row sketch how many of the given rows are
+   * already in the trie, correcting for the expected hash collisions; exact
+   * when the sketch has one bit per row. A cheap
+   * stand-in for false_insert when ranking tries: rows already in a trie
+   * extend existing paths instead of starting new ones at the root.
+   *
+   * @param rows Pointer to the array of row indices.
+   * @param size Number of rows.
+   * @return Estimated number of rows present in the trie.
+   */
+  double estimate_overlap(const index_t *rows, size_t size) const;
 
   /**
    * @brief Performs a "true" insertion phase in the trie after all false
@@ -123,6 +221,23 @@ public:
    */
   bool is_empty();
 
+  /**
+   * @brief Estimates the heap memory held by the trie: its nodes, the row
+   * numbers stored in them and the entries of the insertion maps.
+   *
+   * @return Estimated size in bytes.
+   */
+  size_t memory_usage() const;
+
+  /**
+   * @brief Estimates the worst-case memory a single false insertion of a
+   * column adds to a trie, i.e. one new node and one map entry per row.
+   *
+   * @param size Number of rows in the column.
+   * @return Estimated size in bytes.
+   */
+  static size_t estimate_insert_bytes(size_t size);
+
   /**
    * @brief Prints the entire trie structure to stdout for debugging.
    */
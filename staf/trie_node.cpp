@@ -1,14 +1,17 @@
 #include "trie_node.hpp"
 
-trie_node::trie_node()
+template <typename index_t>
+trie_node<index_t>::trie_node()
     : index(-1), row_numbers(), children(), parent(nullptr),
       false_insert(false) {}
 
-trie_node::trie_node(int idx, bool fi)
+template <typename index_t>
+trie_node<index_t>::trie_node(index_t idx, bool fi)
     : index(idx), row_numbers(), children(), parent(nullptr), false_insert(fi) {
 }
 
-trie_node *trie_node::add_child(int idx, bool fi) {
+template <typename index_t>
+trie_node<index_t> *trie_node<index_t>::add_child(index_t idx, bool fi) {
   for (auto &child : children) {
     if (child->index == idx)
       return child.get();
@@ -19,7 +22,8 @@ trie_node *trie_node::add_child(int idx, bool fi) {
   return children.back().get();
 }
 
-trie_node *trie_node::get_child(int idx) const {
+template <typename index_t>
+trie_node<index_t> *trie_node<index_t>::get_child(index_t idx) const {
   for (size_t i = 0; i < children.size(); ++i) {
     if (children[i]->index == idx)
       return children[i].get();
@@ -27,46 +31,81 @@ trie_node *trie_node::get_child(int idx) const {
   return nullptr;
 }
 
-bool trie_node::has_child(int idx) const { return get_child(idx) != nullptr; }
+template <typename index_t>
+bool trie_node<index_t>::has_child(index_t idx) const {
+  return get_child(idx) != nullptr;
+}
 
-void trie_node::remove_child_if_false_inserted() {
+template <typename index_t>
+size_t trie_node<index_t>::remove_child_if_false_inserted() {
+  size_t removed = 0;
   auto it = children.begin();
   while (it != children.end()) {
     if ((*it)->false_insert) {
       it = children.erase(it);
+      removed++;
     } else {
       ++it;
     }
   }
+  return removed;
 }
 
-void trie_node::add_row_number(int row_num) { row_numbers.insert(row_num); }
+template <typename index_t>
+void trie_node<index_t>::add_row_number(index_t row_num) {
+  // Rows mostly arrive in ascending order, appending is then constant time.
+  row_numbers.insert(row_numbers.end(), row_num);
+}
 
-void trie_node::remove_row(int row) { row_numbers.erase(row); }
+template <typename index_t> void trie_node<index_t>::remove_row(index_t row) {
+  row_numbers.erase(row);
+}
 
-bool trie_node::has_row_number(int row_num) {
+template <typename index_t>
+bool trie_node<index_t>::has_row_number(index_t row_num) {
   return row_numbers.find(row_num) != row_numbers.end();
 }
 
-void trie_node::clear_row_numbers() { row_numbers.clear(); }
+template <typename index_t> void trie_node<index_t>::clear_row_numbers() {
+  row_numbers.clear();
+}
 
-const std::set<int> &trie_node::get_row_numbers() const { return row_numbers; }
+template <typename index_t>
+const std::set<index_t> &trie_node<index_t>::get_row_numbers() const {
+  return row_numbers;
+}
 
-int trie_node::get_index() const { return index; }
+template <typename index_t> index_t trie_node<index_t>::get_index() const {
+  return index;
+}
 
-const std::vector<std::unique_ptr<trie_node>> &trie_node::get_children() const {
+template <typename index_t>
+const std::vector<std::unique_ptr<trie_node<index_t>>> &
+trie_node<index_t>::get_children() const {
   return children;
 }
 
-bool trie_node::is_shared() const {
+template <typename index_t> bool trie_node<index_t>::is_shared() const {
   return (children.size() >= 2 || row_numbers.size() >= 2 ||
           (children.size() >= 1 && row_numbers.size() >= 1));
 }
 
-bool trie_node::is_empty() { return children.empty() && row_numbers.empty(); }
+template <typename index_t> bool trie_node<index_t>::is_empty() {
+  return children.empty() && row_numbers.empty();
+}
 
-bool trie_node::is_false_inserted() { return false_insert; }
+template <typename index_t> bool trie_node<index_t>::is_false_inserted() {
+  return false_insert;
+}
 
-void trie_node::true_insert() { false_insert = false; }
+template <typename index_t> void trie_node<index_t>::true_insert() {
+  false_insert = false;
+}
+
+template <typename index_t>
+trie_node<index_t> *trie_node<index_t>::get_parent() const {
+  return parent;
+}
 
-trie_node *trie_node::get_parent() const { return parent; }
+template class trie_node<int32_t>;
+template class trie_node<int64_t>;
@@ -1,11 +1,18 @@
 #ifndef TRIE_NODE_HPP
 #define TRIE_NODE_HPP
 
+#include <cstdint>
 #include <memory>
 #include <set>
 #include <vector>
 
-class trie_node {
+/**
+ * @class trie_node
+ * @brief Node of a suffix trie.
+ *
+ * @tparam index_t Integer type of the row and column indices.
+ */
+template <typename index_t = int32_t> class trie_node {
 public:
   /**
    * @brief Constructs a root trie node with no index.
@@ -19,7 +26,7 @@ public:
    * @param false_insert Flag indicating if this node was inserted as a "false"
    * insertion.
    */
-  trie_node(int idx, bool false_insert = false);
+  trie_node(index_t idx, bool false_insert = false);
 
   /**
    * @brief Adds a child node with a given index.
@@ -28,7 +35,7 @@ public:
    * @param fi Whether the child node is a false insertion.
    * @return Pointer to the newly created child node.
    */
-  trie_node *add_child(int idx, bool fi = false);
+  trie_node *add_child(index_t idx, bool fi = false);
 
   /**
    * @brief Gets a pointer to the child node with a specific index.
@@ -36,7 +43,7 @@ public:
    * @param idx The index of the child node to retrieve.
    * @return Pointer to the child node, or nullptr if not found.
    */
-  trie_node *get_child(int idx) const;
+  trie_node *get_child(index_t idx) const;
 
   /**
    * @brief Checks if a child node with the given index exists.
@@ -44,26 +51,28 @@ public:
    * @param idx The index to check.
    * @return true if a child with the index exists, false otherwise.
    */
-  bool has_child(int idx) const;
+  bool has_child(index_t idx) const;
 
   /**
    * @brief Removes children that were inserted as "false" insertions.
+   *
+   * @return Number of children removed.
    */
-  void remove_child_if_false_inserted();
+  size_t remove_child_if_false_inserted();
 
   /**
    * @brief Adds a row number to the current node.
    *
    * @param row_num The row number to add.
    */
-  void add_row_number(int row_num);
+  void add_row_number(index_t row_num);
 
   /**
    * @brief Removes a row number from the current node.
    *
    * @param row The row number to remove.
    */
-  void remove_row(int row);
+  void remove_row(index_t row);
 
   /**
    * @brief Checks if the node contains a given row number.
@@ -71,7 +80,7 @@ public:
    * @param row_num The row number to check.
    * @return true if the row number exists in the node, false otherwise.
    */
-  bool has_row_number(int row_num);
+  bool has_row_number(index_t row_num);
 
   /**
    * @brief Clears all stored row numbers from the node.
@@ -83,14 +92,14 @@ public:
    *
    * @return Const reference to the set of row numbers.
    */
-  const std::set<int> &get_row_numbers() const;
+  const std::set<index_t> &get_row_numbers() const;
 
   /**
    * @brief Gets the index (column number) of this node.
    *
    * @return The node's index.
    */
-  int get_index() const;
+  index_t get_index() const;
 
   /**
    * @brief Returns a const reference to the vector of child nodes.
@@ -127,10 +136,10 @@ public:
   trie_node *get_parent() const;
 
 private:
-  int index; ///< Column number this node represents
+  index_t index; ///< Column number this node represents
   trie_node *parent = nullptr;
   std::vector<std::unique_ptr<trie_node>> children; ///< Children nodes
-  std::set<int> row_numbers;                        ///< Row indices (leaf data)
+  std::set<index_t> row_numbers;                    ///< Row indices (leaf data)
   bool false_insert; ///< Flag indicating if the node was a false insertion
 };
 
@@ -0,0 +1,344 @@
+"""Compares the STAF kernels with dense torch references.
+
+Run from the repository root after building the extension:
+
+    python -m pytest tests
+"""
+import pytest
+import torch
+
+from staf import staf_cpp
+from staf.staf import (staf, start_build, staf_shard, local_exchange,
+                       _csc_arguments)
+
+N = 600
+# Generic kernel widths next to the specialized 16 and 256.
+WIDTHS = [1, 7, 16, 100, 256, 300]
+# Forest options the matrices of the tests are built with. The budget is
+# below the memory the tries of the graph take without one.
+BUILD_OPTIONS = {
+    "default": {},
+    "budget": {"max_memory": 50000},
+    "candidates": {"nr_candidates": 2},
+    "growth": {"growth_threshold": 1.5},
+    "retire": {"retire_after": 10},
+}
+
+
+def clustered_graph(n, groups=30, group_size=24, extra=3, seed=0):
+    """Edge list whose rows mostly copy the columns of one of a few groups,
+    so the forest finds shared patterns, plus a few random columns per row
+    and the diagonal, which fixes the shape to n x n."""
+    g = torch.Generator().manual_seed(seed)
+    members = torch.randint(0, n, (groups, group_size), generator=g)
+    group = torch.randint(0, groups, (n,), generator=g)
+    rows = torch.arange(n)
+    edge_index = torch.cat([
+        torch.stack([rows.repeat_interleave(group_size),
+                     members[group].reshape(-1)]),
+        torch.stack([rows.repeat_interleave(extra),
+                     torch.randint(0, n, (n * extra,), generator=g)]),
+        torch.stack([rows, rows]),
+    ], dim=1)
+    return torch.unique(edge_index, dim=1)
+
+
+def hub_graph(n, hubs=4, hub_rows=5000, seed=0):
+    """clustered_graph plus a few hub columns with more rows than
+    hub_column_rows in suffix_forest.cpp. They come last in the build, when
+    the tries already hold rows, and the team inserts each of them."""
+    g = torch.Generator().manual_seed(seed)
+    rows = torch.cat([torch.randperm(n, generator=g)[:hub_rows]
+                      for _ in range(hubs)])
+    cols = torch.arange(hubs).repeat_interleave(hub_rows)
+    return torch.unique(torch.cat([clustered_graph(n, seed=seed),
+                                   torch.stack([rows, cols])], dim=1), dim=1)
+
+
+def build(edge_index, l=2, m=4, **options):
+    """Builds a staf from an edge list without caching it on disk."""
+    args = _csc_arguments(edge_index, torch.ones(edge_index.size(1)))
+    result = staf_cpp.init_staf(*args, l, m, **options)
+    a = staf.from_tensors(*result[:3], n_cols=args[-1])
+    a.memory = result[3]
+    return a
+
+
+def to_dense(edge_index, n):
+    dense = torch.zeros(n, n)
+    dense[edge_index[0], edge_index[1]] = 1.0
+    return dense
+
+
+def rand(*shape, seed=1):
+    return torch.rand(*shape, generator=torch.Generator().manual_seed(seed))
+
+
+@pytest.fixture(scope="module", params=list(BUILD_OPTIONS.values()),
+                ids=list(BUILD_OPTIONS))
+def build_options(request):
+    return request.param
+
+
+@pytest.fixture(scope="module")
+def graph(build_options):
+    edge_index = clustered_graph(N)
+    return build(edge_index, **build_options), to_dense(edge_index, N)
+
+
+def test_build_memory(graph, build_options):
+    a, _ = graph
+    assert a.suffix_tensors[0].numel() > 1
+    assert a.memory["peak_memory"] >= a.memory["final_memory"] > 0
+    if build_options.get("max_memory"):
+        assert a.memory["peak_memory"] <= build_options["max_memory"]
+
+
+def test_budget_below_one_column(capfd):
+    # Every column alone exceeds the budget, the build warns and goes on.
+    edge_index = clustered_graph(N)
+    a = build(edge_index, max_memory=1000)
+    assert "budget will be exceeded" in capfd.readouterr().err
+    x = rand(N, 16)
+    y = torch.empty(N, 16)
+    a.matmul(x, y)
+    torch.testing.assert_close(y, to_dense(edge_index, N) @ x, rtol=1e-5,
+                               atol=1e-4)
+
+
+def test_rejects_no_tries():
+    with pytest.raises(RuntimeError):
+        build(clustered_graph(N), m=0)
+
+
+def test_start_build(graph):
+    _, dense = graph
+    edge_index = dense.nonzero().t()
+    b = start_build(edge_index, torch.ones(edge_index.size(1)), 2, 4).result()
+    assert b.n_cols == N
+    x = rand(N, 16)
+    y = torch.empty(N, 16)
+    b.matmul(x, y)
+    torch.testing.assert_close(y, dense @ x, rtol=1e-5, atol=1e-4)
+
+
+def test_build_progress():
+    edge_index = clustered_graph(N)
+    b = start_build(edge_index, torch.ones(edge_index.size(1)), 2, 4)
+    assert 0.0 <= b.progress() <= 1.0
+    assert b.wait()
+    assert b.done() and b.progress() == 1.0
+    assert b.memory()["peak_memory"] > 0
+
+
+def test_build_timeout_and_cancel():
+    n = 3000
+    edge_index = clustered_graph(n)
+    values = torch.ones(edge_index.size(1))
+    b = start_build(edge_index, values, 2, 4)
+    with pytest.raises(TimeoutError):
+        b.result(timeout=0)
+    # The build went on after the timeout.
+    a = b.result()
+    x = rand(n, 16)
+    y = torch.empty(n, 16)
+    a.matmul(x, y)
+    torch.testing.assert_close(y, to_dense(edge_index, n) @ x, rtol=1e-5,
+                               atol=1e-4)
+
+    b = start_build(edge_index, values, 2, 4)
+    b.cancel()
+    with pytest.raises(RuntimeError, match="cancelled"):
+        b.result()
+    assert b.done() and b.progress() < 1.0
+
+
+@pytest.fixture
+def four_threads():
+    # The build runs on the calling thread and uses its OpenMP thread count.
+    n_threads = torch.get_num_threads()
+    torch.set_num_threads(4)
+    yield
+    torch.set_num_threads(n_threads)
+
+
+@pytest.mark.parametrize("options", [
+    {},
+    {"max_memory": 1 << 20, "nr_candidates": 1, "retire_after": 64},
+], ids=["default", "budget"])
+def test_hub_columns(four_threads, options):
+    # Two tries for four threads, so the team shares every hub column.
+    n = 9000
+    edge_index = hub_graph(n)
+    a = build(edge_index, m=2, **options)
+    reference = torch.sparse_coo_tensor(
+        edge_index, torch.ones(edge_index.size(1)), (n, n))
+    x = rand(n, 16)
+    y = torch.empty(n, 16)
+    a.matmul(x, y)
+    torch.testing.assert_close(y, reference @ x, rtol=1e-5, atol=1e-4)
+
+
+@pytest.fixture(scope="module", params=[False, True], ids=["plain", "packed"])
+def matrix(request, graph):
+    a, dense = graph
+    if request.param:
+        a = staf.from_tensors(a.csr_tensors, a.suffix_tensors, a.map_tensors,
+                              packed=True, n_cols=a.n_cols)
+    return a, dense
+
+
+@pytest.mark.parametrize("width", WIDTHS)
+def test_matmul(matrix, width):
+    a, dense = matrix
+    x = rand(N, width)
+    y = torch.empty(N, width)
+    a.matmul(x, y)
+    torch.testing.assert_close(y, dense @ x, rtol=1e-5, atol=1e-4)
+
+
+@pytest.mark.parametrize("n_parts", [0, 1, 3, 64])
+def test_schedule(graph, n_parts):
+    a, dense = graph
+    # 0 runs without a precomputed schedule.
+    schedule = staf_cpp.schedule_staf(
+        a.csr_tensors, a.suffix_tensors, a.map_tensors,
+        n_parts) if n_parts else []
+    x = rand(N, 7)
+    y = torch.empty(N, 7)
+    staf_cpp.matmul(a.csr_tensors, a.suffix_tensors, a.map_tensors, x, y,
+                    a.n_cols, schedule)
+    torch.testing.assert_close(y, dense @ x, rtol=1e-5, atol=1e-4)
+
+
+def test_rejects_foreign_schedule(graph):
+    a, _ = graph
+    other = build(clustered_graph(N // 2))
+    x = rand(N, 7)
+    y = torch.empty(N, 7)
+    for schedule in [
+            staf_cpp.schedule_staf(other.csr_tensors, other.suffix_tensors,
+                                   other.map_tensors, 3),
+            [t.to(torch.int64) for t in staf_cpp.schedule_staf(
+                a.csr_tensors, a.suffix_tensors, a.map_tensors, 3)]]:
+        with pytest.raises(RuntimeError, match="schedule"):
+            staf_cpp.matmul(a.csr_tensors, a.suffix_tensors, a.map_tensors,
+                            x, y, a.n_cols, schedule)
+
+
+@pytest.mark.parametrize("dtype", [torch.float16, torch.bfloat16])
+@pytest.mark.parametrize("width", [7, 64])
+def test_matmul_half(matrix, dtype, width):
+    a, dense = matrix
+    x = rand(N, width).to(dtype)
+    y = torch.empty(N, width, dtype=dtype)
+    a.matmul(x, y)
+    torch.testing.assert_close(y.float(), dense @ x.float(), rtol=1e-2,
+                               atol=1e-2)
+
+
+@pytest.mark.parametrize("hops", [1, 2, 3, 4])
+@pytest.mark.parametrize("alpha", [0.0, 0.15])
+@pytest.mark.parametrize("scaled", [False, True])
+def test_propagate(matrix, hops, alpha, scaled):
+    a, dense = matrix
+    row_scale = 1.0 / dense.sum(dim=1) if scaled else None
+    x = rand(N, 100)
+    y = torch.empty(N, 100)
+    a.propagate(x, y, hops, alpha, row_scale)
+
+    h = x
+    for _ in range(hops):
+        ah = dense @ h
+        if scaled:
+            ah = row_scale[:, None] * ah
+        h = (1 - alpha) * ah + alpha * x
+    torch.testing.assert_close(y, h, rtol=1e-4, atol=1e-4)
+
+
+def test_rejects_outdated_cache(graph, tmp_path, monkeypatch):
+    a, _ = graph
+    monkeypatch.chdir(tmp_path)
+    # Before the row pattern index, the map held the row count of every
+    # pattern and the rows, nothing else.
+    counts = a.map_tensors[0].diff()
+    torch.save(a.csr_tensors, "csr_old_m_4_l_2.pt")
+    torch.save(a.suffix_tensors, "suffix_old_m_4_l_2.pt")
+    torch.save([counts, a.map_tensors[1]], "map_old_m_4_l_2.pt")
+    with pytest.raises(ValueError, match="re-build"):
+        staf(None, None, 2, 4, "old", skip=True)
+
+    torch.save(a.map_tensors, "map_old_m_4_l_2.pt")
+    b = staf(None, None, 2, 4, "old", skip=True)
+    x = rand(N, 16)
+    y, y_ref = torch.empty(N, 16), torch.empty(N, 16)
+    b.matmul(x, y)
+    a.matmul(x, y_ref)
+    torch.testing.assert_close(y, y_ref)
+
+
+def test_rejects_short_inputs(graph):
+    a, _ = graph
+    with pytest.raises(RuntimeError):
+        a.matmul(rand(N - 1, 16), torch.empty(N, 16))
+    packed = staf.from_tensors(a.csr_tensors, a.suffix_tensors,
+                               a.map_tensors, packed=True, n_cols=a.n_cols)
+    with pytest.raises(RuntimeError):
+        packed.matmul(rand(N - 1, 16), torch.empty(N, 16))
+    with pytest.raises(RuntimeError):
+        a.propagate(rand(N, 16), torch.empty(N, 16), 2,
+                    row_scale=torch.ones(N - 1))
+
+
+def test_spgemm(graph):
+    a, dense = graph
+    n_cols = N + 17
+    b = (rand(N, n_cols, seed=2) < 0.02) * (rand(N, n_cols, seed=3) + 0.5)
+    c = a.spgemm(b.to_sparse_csr())
+    torch.testing.assert_close(c.to_dense(), dense @ b, rtol=1e-5,
+                               atol=1e-5)
+
+    s = a.spgemm(b.to_sparse_csr(), structure=True)
+    x = rand(n_cols, 16)
+    y = torch.empty(N, 16)
+    s.matmul(x, y)
+    structure = ((dense @ (b != 0).float()) != 0).float()
+    torch.testing.assert_close(y, structure @ x, rtol=1e-5, atol=1e-4)
+
+
+def test_spgemm_rejects_mismatched_b(graph):
+    a, _ = graph
+    b = ((rand(N, N, seed=2) < 0.02) * 1.0).to_sparse_csr()
+    tensors = (a.csr_tensors, a.suffix_tensors, a.map_tensors)
+    # B with fewer rows than A has columns.
+    with pytest.raises(RuntimeError, match="b_row_ptr"):
+        staf_cpp.spgemm(*tensors, b.crow_indices()[:-1], b.col_indices(),
+                        b.values(), N, a.n_cols)
+    # Columns of B beyond the width it claims.
+    with pytest.raises(RuntimeError, match="b_col_indices"):
+        staf_cpp.spgemm_structure(*tensors, b.crow_indices(),
+                                  b.col_indices(), N // 2, a.n_cols)
+
+
+@pytest.mark.parametrize("n_shards", [1, 3, 8])
+def test_shards(graph, tmp_path, n_shards):
+    a, dense = graph
+    paths = a.save_shards(str(tmp_path / "a"), n_shards)
+    shards = [staf_shard(path) for path in paths]
+    assert shards[0].row_begin == 0 and shards[-1].row_end == N
+    for s, t in zip(shards, shards[1:]):
+        assert s.row_end == t.row_begin
+
+    # Two hops of A @ x, every shard computing its own rows.
+    x = rand(N, 7)
+    xs = [x[s.row_begin:s.row_end].clone() for s in shards]
+    ys = [torch.empty(s.row_end - s.row_begin, 7) for s in shards]
+    exchange = local_exchange()
+    for _ in range(2):
+        for s, x_owned in zip(shards, xs):
+            exchange.publish(s.row_begin, x_owned)
+        for s, y_owned in zip(shards, ys):
+            s.matmul(exchange, y_owned)
+        xs, ys = ys, xs
+    torch.testing.assert_close(torch.cat(xs), dense @ (dense @ x),
+                               rtol=1e-5, atol=1e-3)